@@ -0,0 +1,452 @@
+/* Compression benchmark: runs compress() and decompress() with Store, LZSS
+   and LZMIT over every file of one or more corpus directories, and reports
+   the encode and decode throughput, the compression ratio and the median
+   and 99th percentile time per call, for every algorithm and file class.
+   The class of a file is its extension, so a corpus laid out as *.spr,
+   *.txt and so on gets one line per kind of asset. */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include <lbatools/compress.h>
+
+
+#define NUM_ALGOS	3
+#define CLASS_LEN	16
+
+
+typedef struct
+{
+    double *	samples;
+    int32_t	samples_no, samples_size;
+    int64_t	bytes;
+    double	time;
+} bench_times_t;
+
+
+typedef struct
+{
+    char		name[CLASS_LEN];
+    int32_t		files;
+    int64_t		bytes, comp_bytes;
+    bench_times_t	enc[NUM_ALGOS], dec[NUM_ALGOS];
+    int64_t		algo_comp[NUM_ALGOS];
+} bench_class_t;
+
+
+static char *		algo_names[NUM_ALGOS] = { "store", "lzss", "lzmit" };
+
+static bench_class_t *	classes = NULL;
+static int32_t		classes_no = 0;
+static double		min_time = 0.05;
+static int		max_runs = 1000, level = COMP_LEVEL_DEFAULT;
+
+
+static double
+get_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    return (double) now.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + ((double) ts.tv_nsec / 1000000000.0);
+#endif
+}
+
+
+static void
+times_add(bench_times_t *t, double sample, int32_t bytes)
+{
+    if (t->samples_no == t->samples_size) {
+	t->samples_size = (t->samples_size == 0) ? 1024 : (t->samples_size << 1);
+	t->samples = (double *) realloc(t->samples, t->samples_size * sizeof(double));
+    }
+
+    t->samples[t->samples_no++] = sample;
+    t->bytes += bytes;
+    t->time += sample;
+}
+
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Nearest rank percentile, in microseconds. Sorts the samples. */
+static double
+times_percentile(bench_times_t *t, double p)
+{
+    int32_t rank;
+
+    if (t->samples_no == 0)
+	return 0.0;
+
+    qsort(t->samples, t->samples_no, sizeof(double), compare_double);
+
+    rank = (int32_t) (p * (double) t->samples_no + 0.999999);
+    if (rank < 1)
+	rank = 1;
+
+    return t->samples[rank - 1] * 1000000.0;
+}
+
+
+static double
+times_mbs(bench_times_t *t)
+{
+    if (t->time <= 0.0)
+	return 0.0;
+
+    return (double) t->bytes / (t->time * 1048576.0);
+}
+
+
+static bench_class_t *
+class_get(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    const char *sep = strrchr(path, '/');
+    char name[CLASS_LEN];
+    int32_t i;
+
+#ifdef _WIN32
+    if ((sep == NULL) || (strrchr(path, '\\') > sep))
+	sep = strrchr(path, '\\');
+#endif
+
+    if ((ext == NULL) || ((sep != NULL) && (ext < sep)) || (ext[1] == '\0'))
+	strcpy(name, "none");
+    else {
+	for (i = 0; (i < (CLASS_LEN - 1)) && (ext[i + 1] != '\0'); i++)
+		name[i] = tolower((unsigned char) ext[i + 1]);
+	name[i] = '\0';
+    }
+
+    for (i = 0; i < classes_no; i++) {
+	if (!strcmp(classes[i].name, name))
+		return &classes[i];
+    }
+
+    classes = (bench_class_t *) realloc(classes, (classes_no + 1) * sizeof(bench_class_t));
+    memset(&classes[classes_no], 0x00, sizeof(bench_class_t));
+    strcpy(classes[classes_no].name, name);
+
+    return &classes[classes_no++];
+}
+
+
+/* Times one algorithm on one file. The calls are repeated until min_time
+   has passed, and every call is one latency sample. Data that an LZ type
+   can not make smaller is counted as stored, like an archive would do. */
+static int
+bench_algo(bench_class_t *bc, int type, char *in, int32_t in_len, char *comp, char *dec)
+{
+    double start, now, total;
+    int32_t comp_len = 0, dec_len = 0, dec_type = type;
+    int runs;
+
+    total = 0.0;
+    for (runs = 0; (runs < max_runs) && ((runs == 0) || (total < min_time)); runs++) {
+	start = get_time();
+	if (level == COMP_LEVEL_DEFAULT)
+		comp_len = compress(type, comp, in, in_len);
+	else
+		comp_len = compress_level(type, level, comp, in, in_len);
+	now = get_time();
+
+	times_add(&bc->enc[type], now - start, in_len);
+	total += now - start;
+    }
+
+    if ((type != 0) && ((comp_len < 0) || (comp_len >= in_len))) {
+	comp_len = compress_store(comp, in, in_len);
+	dec_type = 0;
+    }
+
+    bc->algo_comp[type] += comp_len;
+
+    total = 0.0;
+    for (runs = 0; (runs < max_runs) && ((runs == 0) || (total < min_time)); runs++) {
+	start = get_time();
+	dec_len = decompress(dec_type, dec, comp, comp_len);
+	now = get_time();
+
+	times_add(&bc->dec[type], now - start, in_len);
+	total += now - start;
+    }
+
+    if ((dec_len != in_len) || memcmp(dec, in, in_len)) {
+	fprintf(stderr, "Round trip failed with %s\n", algo_names[type]);
+	return 0;
+    }
+
+    return 1;
+}
+
+
+static int
+bench_file(const char *path)
+{
+    bench_class_t *bc;
+    int32_t in_len;
+    int type, ret = 1;
+    FILE *f;
+    char *in, *comp, *dec;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+	fprintf(stderr, "Unable to open %s\n", path);
+	return 0;
+    }
+
+    fseek(f, 0, SEEK_END);
+    in_len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    in = (char *) malloc(in_len + 1);
+    comp = (char *) malloc(compress_bound(1, in_len) + 1);
+    dec = (char *) malloc(in_len + 1);
+
+    if ((int32_t) fread(in, 1, in_len, f) != in_len) {
+	fprintf(stderr, "Unable to read %s\n", path);
+	ret = 0;
+    }
+    fclose(f);
+
+    if (ret) {
+	bc = class_get(path);
+	bc->files++;
+	bc->bytes += in_len;
+
+	for (type = 0; type < NUM_ALGOS; type++) {
+		if (!bench_algo(bc, type, in, in_len, comp, dec)) {
+			fprintf(stderr, "    in %s\n", path);
+			ret = 0;
+		}
+	}
+    }
+
+    free(dec);
+    free(comp);
+    free(in);
+
+    return ret;
+}
+
+
+static int
+bench_path(const char *path)
+{
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    char *sub;
+    int ret = 1;
+
+    if (stat(path, &st) != 0) {
+	fprintf(stderr, "Unable to find %s\n", path);
+	return 0;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+	return bench_file(path);
+
+    dir = opendir(path);
+    if (dir == NULL) {
+	fprintf(stderr, "Unable to open directory %s\n", path);
+	return 0;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+	if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+		continue;
+
+	sub = (char *) malloc(strlen(path) + strlen(de->d_name) + 2);
+	sprintf(sub, "%s/%s", path, de->d_name);
+	ret &= bench_path(sub);
+	free(sub);
+    }
+
+    closedir(dir);
+
+    return ret;
+}
+
+
+/* Adds the samples of every class into one "all" class at the end. */
+static void
+classes_total(void)
+{
+    bench_class_t all;
+    int32_t i, j, k;
+
+    memset(&all, 0x00, sizeof(bench_class_t));
+    strcpy(all.name, "all");
+
+    for (i = 0; i < classes_no; i++) {
+	all.files += classes[i].files;
+	all.bytes += classes[i].bytes;
+
+	for (j = 0; j < NUM_ALGOS; j++) {
+		all.algo_comp[j] += classes[i].algo_comp[j];
+		for (k = 0; k < classes[i].enc[j].samples_no; k++)
+			times_add(&all.enc[j], classes[i].enc[j].samples[k], 0);
+		for (k = 0; k < classes[i].dec[j].samples_no; k++)
+			times_add(&all.dec[j], classes[i].dec[j].samples[k], 0);
+		all.enc[j].bytes += classes[i].enc[j].bytes;
+		all.dec[j].bytes += classes[i].dec[j].bytes;
+	}
+    }
+
+    classes = (bench_class_t *) realloc(classes, (classes_no + 1) * sizeof(bench_class_t));
+    classes[classes_no++] = all;
+}
+
+
+static void
+report_text(void)
+{
+    bench_class_t *bc;
+    int32_t i;
+    int j;
+
+    printf("%-6s %-8s %6s %12s %7s %10s %10s %10s %10s %10s %10s\n", "Algo", "Class", "Files", "Bytes",
+	   "Ratio", "Enc MB/s", "Dec MB/s", "Enc p50us", "Enc p99us", "Dec p50us", "Dec p99us");
+
+    for (j = 0; j < NUM_ALGOS; j++) {
+	for (i = 0; i < classes_no; i++) {
+		bc = &classes[i];
+		printf("%-6s %-8s %6i %12" PRIi64 " %7.4f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+		       algo_names[j], bc->name, bc->files, bc->bytes,
+		       bc->bytes ? ((double) bc->algo_comp[j] / (double) bc->bytes) : 0.0,
+		       times_mbs(&bc->enc[j]),
+		       times_mbs(&bc->dec[j]),
+		       times_percentile(&bc->enc[j], 0.50), times_percentile(&bc->enc[j], 0.99),
+		       times_percentile(&bc->dec[j], 0.50), times_percentile(&bc->dec[j], 0.99));
+	}
+    }
+}
+
+
+static void
+report_json(void)
+{
+    bench_class_t *bc;
+    int32_t i, n = 0;
+    int j;
+
+    printf("{\n  \"tool\": \"comp_bench\",\n  \"level\": %i,\n  \"min_time\": %g,\n  \"results\": [\n",
+	   level, min_time);
+
+    for (j = 0; j < NUM_ALGOS; j++) {
+	for (i = 0; i < classes_no; i++) {
+		bc = &classes[i];
+		printf("%s    {\"algorithm\": \"%s\", \"class\": \"%s\", \"files\": %i, \"bytes\": %" PRIi64
+		       ", \"compressed\": %" PRIi64 ", \"ratio\": %.6f, \"encode_mbs\": %.3f, \"decode_mbs\": %.3f"
+		       ", \"encode_p50_us\": %.3f, \"encode_p99_us\": %.3f, \"decode_p50_us\": %.3f"
+		       ", \"decode_p99_us\": %.3f}",
+		       (n++ > 0) ? ",\n" : "", algo_names[j], bc->name, bc->files, bc->bytes, bc->algo_comp[j],
+		       bc->bytes ? ((double) bc->algo_comp[j] / (double) bc->bytes) : 0.0,
+		       times_mbs(&bc->enc[j]),
+		       times_mbs(&bc->dec[j]),
+		       times_percentile(&bc->enc[j], 0.50), times_percentile(&bc->enc[j], 0.99),
+		       times_percentile(&bc->dec[j], 0.50), times_percentile(&bc->dec[j], 0.99));
+	}
+    }
+
+    printf("\n  ]\n}\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i, json = 0, ret = 0, paths = 0;
+    int32_t j;
+    int k;
+
+    for (i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "-j"))
+		json = 1;
+	else if (!strcmp(argv[i], "-l") && ((i + 1) < argc))
+		level = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-t") && ((i + 1) < argc))
+		min_time = atof(argv[++i]) / 1000.0;
+	else if (!strcmp(argv[i], "-n") && ((i + 1) < argc))
+		max_runs = atoi(argv[++i]);
+	else if (argv[i][0] == '-') {
+		paths = 0;
+		break;
+	} else
+		paths++;
+    }
+
+    if (!json)
+	printf("LBA Compression Benchmark Program\n\n");
+
+    if ((paths == 0) || (max_runs < 1)) {
+	printf("Usage: comp_bench [-j] [-l LEVEL] [-t MS] [-n RUNS] DIRECTORY|FILE [...]\n\n");
+	printf("-j: JSON output\n");
+	printf("-l: Compression level (default 0, the original encoders)\n");
+	printf("-t: Minimum time to spend on each file and algorithm, in ms (default 50)\n");
+	printf("-n: Maximum number of calls per file and algorithm (default 1000)\n");
+	printf("Directories are searched recursively; the extension of a file is its class.\n");
+	return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+	if (argv[i][0] == '-') {
+		if (strcmp(argv[i], "-j"))
+			i++;
+		continue;
+	}
+
+	if (!bench_path(argv[i]))
+		ret = 2;
+    }
+
+    if (classes_no == 0) {
+	fprintf(stderr, "No files found\n");
+	return 3;
+    }
+
+    classes_total();
+
+    if (json)
+	report_json();
+    else
+	report_text();
+
+    for (j = 0; j < classes_no; j++) {
+	for (k = 0; k < NUM_ALGOS; k++) {
+		free(classes[j].enc[k].samples);
+		free(classes[j].dec[k].samples);
+	}
+    }
+    free(classes);
+
+    return ret;
+}
@@ -3,19 +3,207 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+# include <fcntl.h>
+# include <io.h>
+#endif
 
 #include <lbatools/compress.h>
 
 
+/* Size of each of the two read buffers in pipe mode. */
+#define PIPE_BUF_SIZE	(1024 * 1024)
+
+
+/* Double-buffered reader for pipe mode: a thread fills one buffer while the
+   main thread is (de)compressing the other one. */
+typedef struct
+{
+    FILE *		f;
+    char *		buf[2];
+    int32_t		len[2];
+    int			full[2];
+    pthread_mutex_t	mutex;
+    pthread_cond_t	cond;
+} reader_t;
+
+
+static FILE *	msg;
+
+
 static int
 file_exists(char *fn)
 {
     FILE *f;
-    int ret;
 
     f = fopen(fn, "rb");
-    ret = (f == NULL) ? 0 : 1;
+    if (f == NULL)
+	return 0;
+
     fclose(f);
+    return 1;
+}
+
+
+static void *
+reader_thread(void *priv)
+{
+    reader_t *r = (reader_t *) priv;
+    int32_t n;
+    int i = 0;
+
+    do {
+	pthread_mutex_lock(&r->mutex);
+	while (r->full[i])
+		pthread_cond_wait(&r->cond, &r->mutex);
+	pthread_mutex_unlock(&r->mutex);
+
+	n = (int32_t) fread(r->buf[i], 1, PIPE_BUF_SIZE, r->f);
+
+	pthread_mutex_lock(&r->mutex);
+	r->len[i] = n;
+	r->full[i] = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+
+	i ^= 1;
+    } while (n > 0);
+
+    return NULL;
+}
+
+
+/* Waits for buffer i to be filled and returns its length, 0 at the end. */
+static int32_t
+reader_get(reader_t *r, int i)
+{
+    int32_t n;
+
+    pthread_mutex_lock(&r->mutex);
+    while (!r->full[i])
+	pthread_cond_wait(&r->cond, &r->mutex);
+    n = r->len[i];
+    pthread_mutex_unlock(&r->mutex);
+
+    return n;
+}
+
+
+/* Hands buffer i back to the reader thread. */
+static void
+reader_put(reader_t *r, int i)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->full[i] = 0;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+
+static int32_t
+write_file(void *priv, const char *buf, int32_t len)
+{
+    return (int32_t) fwrite(buf, 1, len, (FILE *) priv);
+}
+
+
+/* Pipe mode: streams the input through the streaming encoder or decoder,
+   so memory use does not depend on the size of the data. */
+static int
+run_pipe(int dir, int type, FILE *in_f, FILE *out_f, int64_t *in_total, int64_t *out_total)
+{
+    reader_t r;
+    pthread_t thread;
+    comp_stream_t *cs = NULL;
+    decomp_stream_t *ds = NULL;
+    char *out = NULL;
+    int32_t n, used, pos, written;
+    int i = 0, ret = 0;
+
+    memset(&r, 0x00, sizeof(reader_t));
+    r.f = in_f;
+    r.buf[0] = (char *) malloc(PIPE_BUF_SIZE);
+    r.buf[1] = (char *) malloc(PIPE_BUF_SIZE);
+
+    if (dir) {
+	ds = decomp_stream_new(type);
+	out = (char *) malloc(PIPE_BUF_SIZE);
+    } else
+	cs = comp_stream_new(type, write_file, out_f);
+
+    if ((r.buf[0] == NULL) || (r.buf[1] == NULL) || (dir && ((ds == NULL) || (out == NULL))) ||
+	(!dir && (cs == NULL))) {
+	fprintf(msg, "Out of memory\n");
+	free(r.buf[0]);
+	free(r.buf[1]);
+	free(out);
+	decomp_stream_free(ds);
+	comp_stream_free(cs);
+	return 5;
+    }
+
+    pthread_mutex_init(&r.mutex, NULL);
+    pthread_cond_init(&r.cond, NULL);
+    pthread_create(&thread, NULL, reader_thread, &r);
+
+    *in_total = *out_total = 0;
+
+    while ((n = reader_get(&r, i)) > 0) {
+	*in_total += n;
+
+	if (dir) {
+		pos = 0;
+		do {
+			written = decomp_stream_run(ds, r.buf[i] + pos, n - pos, &used, out, PIPE_BUF_SIZE);
+			if (written < 0) {
+				fprintf(msg, "Corrupt compressed stream\n");
+				ret = 6;
+				break;
+			}
+			if (fwrite(out, 1, written, out_f) != (size_t) written)
+				ret = 7;
+			*out_total += written;
+			pos += used;
+		} while ((ret == 0) && ((pos < n) || (written == PIPE_BUF_SIZE)));
+	} else if (comp_stream_write(cs, r.buf[i], n) < 0)
+		ret = 7;
+
+	reader_put(&r, i);
+	i ^= 1;
+
+	if (ret != 0)
+		break;
+    }
+
+    /* Let the reader thread run to the end of its input so it can exit. */
+    while (n > 0) {
+	n = reader_get(&r, i);
+	reader_put(&r, i);
+	i ^= 1;
+    }
+    pthread_join(thread, NULL);
+
+    if (!dir) {
+	if (ret == 0) {
+		*out_total = comp_stream_finish(cs);
+		if (*out_total < 0)
+			ret = 7;
+	}
+	comp_stream_free(cs);
+    } else {
+	decomp_stream_free(ds);
+	free(out);
+    }
+
+    if (ret == 7)
+	fprintf(msg, "Error writing the output\n");
+
+    pthread_cond_destroy(&r.cond);
+    pthread_mutex_destroy(&r.mutex);
+    free(r.buf[0]);
+    free(r.buf[1]);
+
     return ret;
 }
 
@@ -23,48 +211,92 @@ file_exists(char *fn)
 int
 main(int argc, char *argv[])
 {
-    int dir, type, in_len, out_len;
-    FILE *f;
+    int dir, type, in_len, out_len, out_size, ret;
+    int64_t size;
+    int in_pipe, out_pipe;
+    int64_t in_total, out_total;
+    FILE *f, *in_f, *out_f;
     char *in, *out;
 
-    printf("LBA Compression Test Program\n\n");
+    /* With the output going to stdout, all messages go to stderr. */
+    out_pipe = (argc == 5) && !strcmp(argv[4], "-");
+    msg = out_pipe ? stderr : stdout;
+
+    fprintf(msg, "LBA Compression Test Program\n\n");
 
     if (argc != 5) {
-	printf("Usage: Compress D N FILENAME.EXT FILENAME.EXT\n\n");
-	printf("D: C = Compress, D = Decompress\n");
-	printf("N: 1 = LZSS, 2 = LZMIT\n");
+	fprintf(msg, "Usage: Compress D N FILENAME.EXT FILENAME.EXT\n\n");
+	fprintf(msg, "D: C = Compress, D = Decompress\n");
+	fprintf(msg, "N: 1 = LZSS, 2 = LZMIT\n");
+	fprintf(msg, "Either file name may be - for stdin/stdout, which streams the data\n");
+	fprintf(msg, "through the streaming encoder/decoder in constant memory.\n");
     } else {
 	if (!stricmp(argv[1], "C"))
 		dir = 0;	/* Compress. */
 	else if (!stricmp(argv[1], "D"))
 		dir = 1;	/* Decompress. */
 	else {
-		printf("Invalid direction: %s\n", argv[1]);
+		fprintf(msg, "Invalid direction: %s\n", argv[1]);
 		return 1;
 	}
 
 	type = atoi(argv[2]);
 
 	if ((type < 1) || (type > 2)) {
-		printf("Invalid %scompression type: %s\n", dir ? "de" : "", argv[2]);
+		fprintf(msg, "Invalid %scompression type: %s\n", dir ? "de" : "", argv[2]);
 		return 2;
 	} else if (type == 0)
-		printf("%s using Store\n", dir ? "Decompressing" : "Compressing");
+		fprintf(msg, "%s using Store\n", dir ? "Decompressing" : "Compressing");
 	else if (type == 1)
-		printf("%s using LZSS\n", dir ? "Decompressing" : "Compressing");
+		fprintf(msg, "%s using LZSS\n", dir ? "Decompressing" : "Compressing");
 	else
-		printf("%s using LZMIT\n", dir ? "Decompressing" : "Compressing");
+		fprintf(msg, "%s using LZMIT\n", dir ? "Decompressing" : "Compressing");
 
-	if (!file_exists(argv[3])) {
-		printf("File does not exist: %s\n", argv[3]);
+	in_pipe = !strcmp(argv[3], "-");
+
+	if (!in_pipe && !file_exists(argv[3])) {
+		fprintf(msg, "File does not exist: %s\n", argv[3]);
 		return 3;
 	}
 
-	if (file_exists(argv[4])) {
-		printf("File already exists: %s\n", argv[4]);
+	if (!out_pipe && file_exists(argv[4])) {
+		fprintf(msg, "File already exists: %s\n", argv[4]);
 		remove(argv[4]);
 	}
 
+	if (in_pipe || out_pipe) {
+#ifdef _WIN32
+		if (in_pipe)
+			_setmode(_fileno(stdin), _O_BINARY);
+		if (out_pipe)
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		in_f = in_pipe ? stdin : fopen(argv[3], "rb");
+		out_f = out_pipe ? stdout : fopen(argv[4], "wb");
+		if ((in_f == NULL) || (out_f == NULL)) {
+			fprintf(msg, "Unable to open the %s file\n", (in_f == NULL) ? "input" : "output");
+			return 4;
+		}
+
+		ret = run_pipe(dir, type, in_f, out_f, &in_total, &out_total);
+
+		if (!in_pipe)
+			fclose(in_f);
+		if (out_pipe)
+			fflush(out_f);
+		else
+			fclose(out_f);
+
+		if (ret != 0)
+			return ret;
+
+		fprintf(msg, "%s\n", dir ? "Decompressed:" : "Compressed:");
+		fprintf(msg, "    Source: %s (%" PRIi64 " bytes)\n", in_pipe ? "stdin" : argv[3], in_total);
+		fprintf(msg, "    Destination: %s (%" PRIi64 " bytes)\n", out_pipe ? "stdout" : argv[4], out_total);
+
+		return 0;
+	}
+
 	f = fopen(argv[3], "rb");
 	fseek(f, 0, SEEK_END);
 	in_len = ftell(f);
@@ -73,12 +305,34 @@ main(int argc, char *argv[])
 	fread(in, 1, in_len, f);
 	fclose(f);
 
-	out = (char *) malloc(in_len << 1);
+	/* A two byte match token decodes to at most 18 bytes, so nothing can
+	   decompress to more than nine times its size. */
+	size = dir ? ((int64_t) in_len * 9) : compress_bound(type, in_len);
+	if ((size < 0) || (size > INT32_MAX)) {
+		fprintf(msg, "The file is too big, use - for the output to stream it\n");
+		free(in);
+		return 5;
+	}
+	out_size = (int32_t) size;
+	out = (char *) malloc(out_size);
+	if ((in == NULL) || (out == NULL)) {
+		fprintf(msg, "Out of memory, use - for the output to stream it\n");
+		free(out);
+		free(in);
+		return 5;
+	}
 
 	if (dir)
-		out_len = decompress(type, out, in, in_len);
+		out_len = decompress_safe(type, out, out_size, in, in_len);
 	else
-		out_len = compress(type, out, in, in_len);
+		out_len = compress_safe(type, out, out_size, in, in_len);
+
+	if (out_len < 0) {
+		fprintf(msg, dir ? "Corrupt compressed data\n" : "The data does not compress, nothing written\n");
+		free(out);
+		free(in);
+		return 6;
+	}
 
 	f = fopen(argv[4], "wb");
 	fwrite(out, 1, out_len, f);
@@ -87,10 +341,10 @@ main(int argc, char *argv[])
 	free(out);
 	free(in);
 
-	printf("%s\n", dir ? "Decompressed:" : "Compressed:");
-	printf("    Source file: %s (%i bytes)\n", argv[3], in_len);
-	printf("    Destination file: %s (%i bytes)\n", argv[4], out_len);
+	fprintf(msg, "%s\n", dir ? "Decompressed:" : "Compressed:");
+	fprintf(msg, "    Source file: %s (%i bytes)\n", argv[3], in_len);
+	fprintf(msg, "    Destination file: %s (%i bytes)\n", argv[4], out_len);
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,540 @@
+/* Synthetic corpus generator: writes seeded, reproducible files that look
+   like the asset classes of the game, so that codec and loader benchmarks
+   can share their input without shipping the original HQR files:
+	- *.spr: palette indexed sprites, made of long runs of a few shades;
+	- *.txt: text banks, a table of 16-bit offsets followed by strings;
+	- *.mdl: model tables of vertices and polygons;
+	- *.anm: animation tables of slowly changing keyframes;
+	- *.raw: audio-like noise, which LZ can not compress;
+	- *.hqr: archives of all of the above, with NULL, pointer and child
+	  entries, and a mix of Store, LZSS and LZMIT.
+   The same seed always gives the same bytes, whatever the platform, and
+   each file has its own stream, so -n does not change the earlier files. */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <direct.h>
+#endif
+
+#include <lbatools/compress.h>
+
+
+#define NUM_CLASSES	5
+
+#define ENTRY_NULL	0
+#define ENTRY_NORMAL	1
+#define ENTRY_POINTER	2
+
+
+typedef struct
+{
+    uint8_t *	data;
+    int32_t	len, size;
+} gen_buf_t;
+
+
+typedef struct
+{
+    int		entry_type;
+    int32_t	parent, children_no, offset;
+} gen_entry_t;
+
+
+typedef void	(*gen_func_t)(gen_buf_t *b, int32_t size);
+
+
+static char *		class_names[NUM_CLASSES] = { "spr", "txt", "mdl", "anm", "raw" };
+
+static char *		words[64] = {
+    "the", "of", "and", "to", "a", "in", "is", "you", "that", "it",
+    "he", "was", "for", "on", "are", "with", "they", "be", "at", "one",
+    "have", "this", "from", "by", "hot", "but", "some", "what", "there", "we",
+    "Twinsen", "Zoe", "Funfrock", "Citadel", "island", "clone", "ferry", "magic", "ball", "tunic",
+    "key", "guard", "sendell", "dinofly", "lighthouse", "harbour", "prison", "pharmacy", "quetch", "grobo",
+    "sphero", "rabbibunny", "kashes", "clover", "leaf", "behaviour", "mode", "normal", "sporty", "aggressive",
+    "discreet", "hello", "help", "escape"
+};
+
+static uint64_t		rng_state;
+
+
+/* xorshift64*, so the output does not depend on the C library. */
+static uint32_t
+rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return (uint32_t) ((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+
+static void
+rng_seed(uint32_t seed, int stream, int index)
+{
+    int i;
+
+    rng_state = ((uint64_t) seed * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t) (stream + 1) << 40) ^
+		((uint64_t) index << 8) ^ 0x5851f42d4c957f2dULL;
+    if (rng_state == 0)
+	rng_state = 1;
+
+    for (i = 0; i < 8; i++)
+	rng_next();
+}
+
+
+static int32_t
+rng_range(int32_t n)
+{
+    return (n <= 1) ? 0 : (int32_t) (rng_next() % (uint32_t) n);
+}
+
+
+static void
+buf_put8(gen_buf_t *b, int val)
+{
+    if (b->len == b->size) {
+	b->size = (b->size == 0) ? 4096 : (b->size << 1);
+	b->data = (uint8_t *) realloc(b->data, b->size);
+    }
+
+    b->data[b->len++] = val & 0xff;
+}
+
+
+static void
+buf_put16(gen_buf_t *b, int val)
+{
+    buf_put8(b, val);
+    buf_put8(b, val >> 8);
+}
+
+
+/* Rows of runs in a few shades of one palette ramp, on a transparent
+   background, and most rows are the previous row with a few runs moved. */
+static void
+gen_sprite(gen_buf_t *b, int32_t size)
+{
+    int32_t w, h, x, y, len, start;
+    uint8_t ramp[6], *row;
+    int i, color;
+
+    w = 32 + rng_range(224);
+    h = (size - 4) / w;
+    if (h < 1)
+	h = 1;
+
+    for (i = 0; i < 6; i++)
+	ramp[i] = 16 + (rng_range(14) << 4) + i * 2;
+
+    buf_put16(b, w);
+    buf_put16(b, h);
+
+    for (y = 0; y < h; y++) {
+	start = b->len;
+	if ((y > 0) && (rng_range(10) < 7)) {
+		for (x = 0; x < w; x++)
+			buf_put8(b, b->data[start - w + x]);
+		for (i = rng_range(4); i > 0; i--) {
+			row = b->data + start;
+			x = rng_range(w);
+			len = 1 + rng_range(8);
+			color = ramp[rng_range(6)];
+			while ((len-- > 0) && (x < w))
+				row[x++] = color;
+		}
+	} else {
+		x = 0;
+		while (x < w) {
+			len = 1 + rng_range(4) + ((rng_range(4) == 0) ? rng_range(w) : rng_range(16));
+			color = (rng_range(3) == 0) ? 0 : ramp[rng_range(6)];
+			while ((len-- > 0) && (x++ < w))
+				buf_put8(b, color);
+		}
+	}
+    }
+}
+
+
+/* Sentences of words picked with a skew towards the start of the list, so
+   the common words are common, behind a table of 16-bit string offsets. */
+static void
+gen_text(gen_buf_t *b, int32_t size)
+{
+    gen_buf_t s;
+    int32_t *offsets = NULL;
+    int32_t i, n = 0, count;
+    char *w;
+
+    memset(&s, 0x00, sizeof(gen_buf_t));
+
+    while (((s.len + (n << 1)) < size) && ((s.len + (n << 1)) < 65000)) {
+	offsets = (int32_t *) realloc(offsets, (n + 1) * sizeof(int32_t));
+	offsets[n++] = s.len;
+
+	count = 3 + rng_range(18);
+	for (i = 0; i < count; i++) {
+		w = words[rng_range(1 + rng_range(64))];
+		if (i > 0)
+			buf_put8(&s, ' ');
+		buf_put8(&s, ((i == 0) && (w[0] >= 'a')) ? (w[0] - 0x20) : w[0]);
+		while (*++w)
+			buf_put8(&s, *w);
+	}
+	buf_put8(&s, (rng_range(4) == 0) ? '!' : '.');
+	buf_put8(&s, 0x00);
+    }
+
+    for (i = 0; i < n; i++)
+	buf_put16(b, (n << 1) + offsets[i]);
+    for (i = 0; i < s.len; i++)
+	buf_put8(b, s.data[i]);
+
+    free(offsets);
+    free(s.data);
+}
+
+
+/* A vertex table that walks around a body, then polygons with a few
+   colours and indices close to each other. */
+static void
+gen_model(gen_buf_t *b, int32_t size)
+{
+    int32_t i, j, verts, polys, count;
+    int x = 0, y = 0, z = 0, base;
+
+    verts = (size / 3) / 6;
+    if (verts < 4)
+	verts = 4;
+    polys = (size - 4 - verts * 6) / 10;
+    if (polys < 1)
+	polys = 1;
+
+    buf_put16(b, verts);
+    buf_put16(b, polys);
+
+    for (i = 0; i < verts; i++) {
+	x += rng_range(65) - 32;
+	y += rng_range(33) - 16;
+	z += rng_range(65) - 32;
+	buf_put16(b, x);
+	buf_put16(b, y);
+	buf_put16(b, z);
+    }
+
+    for (i = 0; i < polys; i++) {
+	count = 3 + rng_range(2);
+	base = rng_range(verts - 4);
+	buf_put8(b, (rng_range(4) == 0) ? 2 : 1);
+	buf_put8(b, count);
+	buf_put16(b, 16 + (rng_range(8) << 4));
+	for (j = 0; j < (count - 1); j++)
+		buf_put16(b, base + rng_range(4));
+    }
+}
+
+
+/* Keyframes of per-bone rotations that only drift a little from one frame
+   to the next, as in the animation files. */
+static void
+gen_anim(gen_buf_t *b, int32_t size)
+{
+    int32_t i, j, k, frames, bones;
+    int16_t rot[64][3];
+    int type[64];
+
+    bones = 8 + rng_range(32);
+    frames = (size - 8) / (2 + bones * 8);
+    if (frames < 1)
+	frames = 1;
+
+    for (j = 0; j < bones; j++) {
+	type[j] = rng_range(4) == 0;
+	for (k = 0; k < 3; k++)
+		rot[j][k] = (rng_range(4) == 0) ? rng_range(1024) : 0;
+    }
+
+    buf_put16(b, frames);
+    buf_put16(b, bones);
+    buf_put16(b, rng_range(frames));
+    buf_put16(b, 0);
+
+    for (i = 0; i < frames; i++) {
+	buf_put16(b, 50 + (rng_range(4) * 50));
+	for (j = 0; j < bones; j++) {
+		buf_put16(b, type[j]);
+		for (k = 0; k < 3; k++) {
+			if (rng_range(3) == 0)
+				rot[j][k] = (rot[j][k] + rng_range(33) - 16) & 0x3ff;
+			buf_put16(b, rot[j][k]);
+		}
+	}
+    }
+}
+
+
+/* 8-bit unsigned samples of filtered white noise. */
+static void
+gen_noise(gen_buf_t *b, int32_t size)
+{
+    int32_t i;
+    int s = 0;
+
+    for (i = 0; i < size; i++) {
+	s = (s + ((int) (rng_next() & 0xff) - 128)) / 2;
+	buf_put8(b, 128 + s);
+    }
+}
+
+
+static gen_func_t	class_funcs[NUM_CLASSES] = { gen_sprite, gen_text, gen_model, gen_anim, gen_noise };
+
+
+/* Sizes are spread between half and one and a half times the mean. */
+static int32_t
+gen_size(int32_t mean)
+{
+    return (mean >> 1) + rng_range(mean + 1);
+}
+
+
+static int
+write_file(char *path, uint8_t *data, int32_t len)
+{
+    FILE *f;
+    int ret;
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+	fprintf(stderr, "Unable to create %s\n", path);
+	return 0;
+    }
+
+    ret = (fwrite(data, 1, len, f) == (size_t) len);
+    fclose(f);
+
+    return ret;
+}
+
+
+static void
+write32(FILE *f, int32_t val)
+{
+    uint8_t b[4];
+
+    b[0] = val & 0xff;
+    b[1] = (val >> 8) & 0xff;
+    b[2] = (val >> 16) & 0xff;
+    b[3] = (val >> 24) & 0xff;
+
+    fwrite(b, 1, 4, f);
+}
+
+
+/* Writes one resource: the 10 byte header and the data, compressed with the
+   given type unless that does not make it smaller, like hqr_entry_new(). */
+static int32_t
+write_resource(FILE *f, int type, gen_buf_t *b)
+{
+    char *comp;
+    int32_t comp_len;
+    uint8_t hdr[2];
+
+    comp = (char *) malloc(b->len + 1);
+
+    comp_len = compress_safe(type, comp, b->len, (char *) b->data, b->len);
+    if (comp_len < 0) {
+	type = 0;
+	comp_len = compress_store(comp, (char *) b->data, b->len);
+    }
+
+    write32(f, b->len);
+    write32(f, comp_len);
+    hdr[0] = type & 0xff;
+    hdr[1] = (type >> 8) & 0xff;
+    fwrite(hdr, 1, 2, f);
+    fwrite(comp, 1, comp_len, f);
+
+    free(comp);
+
+    return comp_len + 10;
+}
+
+
+/* Archive layout: a table of entries + 1 offsets, the last one being the
+   end of the file, then each normal entry followed by its children. A NULL
+   entry has an offset of 0 and a pointer repeats an earlier offset. The
+   first entry is always a normal one, as the loader finds the end of the
+   table from its offset. */
+static int
+gen_archive(char *path, int32_t entries_no, int32_t mean, int32_t *stats)
+{
+    gen_entry_t *entries;
+    gen_buf_t b;
+    int32_t i, j, offset, normal_no = 0;
+    int r;
+    FILE *f;
+
+    entries = (gen_entry_t *) malloc(entries_no * sizeof(gen_entry_t));
+    memset(entries, 0x00, entries_no * sizeof(gen_entry_t));
+    memset(&b, 0x00, sizeof(gen_buf_t));
+
+    for (i = 0; i < entries_no; i++) {
+	r = rng_range(100);
+	if ((i > 0) && (r < 8))
+		entries[i].entry_type = ENTRY_NULL;
+	else if ((i > 0) && (r < 20)) {
+		entries[i].entry_type = ENTRY_POINTER;
+		do
+			entries[i].parent = rng_range(i);
+		while (entries[entries[i].parent].entry_type != ENTRY_NORMAL);
+	} else {
+		entries[i].entry_type = ENTRY_NORMAL;
+		entries[i].children_no = (rng_range(5) == 0) ? (1 + rng_range(3)) : 0;
+	}
+    }
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+	fprintf(stderr, "Unable to create %s\n", path);
+	free(entries);
+	return 0;
+    }
+
+    for (i = 0; i <= entries_no; i++)
+	write32(f, 0x00000000);
+    offset = (entries_no + 1) << 2;
+
+    for (i = 0; i < entries_no; i++) {
+	if (entries[i].entry_type == ENTRY_NULL) {
+		stats[0]++;
+		continue;
+	} else if (entries[i].entry_type == ENTRY_POINTER) {
+		entries[i].offset = entries[entries[i].parent].offset;
+		stats[1]++;
+		continue;
+	}
+
+	entries[i].offset = offset;
+	normal_no++;
+
+	for (j = 0; j <= entries[i].children_no; j++) {
+		b.len = 0;
+		r = rng_range(NUM_CLASSES);
+		class_funcs[r](&b, gen_size(mean));
+		offset += write_resource(f, rng_range(3), &b);
+	}
+	stats[2] += entries[i].children_no;
+    }
+
+    fseek(f, 0, SEEK_SET);
+    for (i = 0; i < entries_no; i++)
+	write32(f, entries[i].offset);
+    write32(f, offset);
+    fclose(f);
+
+    stats[3] += normal_no;
+    stats[4] += offset;
+
+    free(b.data);
+    free(entries);
+
+    return 1;
+}
+
+
+static void
+make_dir(char *path)
+{
+#ifdef _WIN32
+    _mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    gen_buf_t b;
+    uint32_t seed = 1;
+    int32_t count = 8, mean = 64, archives = 2, entries_no = 64;
+    int32_t stats[5], bytes;
+    int i, c, ret = 0;
+    char *dir = NULL, *path;
+
+    printf("LBA Synthetic Corpus Generator\n\n");
+
+    for (i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "-s") && ((i + 1) < argc))
+		seed = (uint32_t) strtoul(argv[++i], NULL, 0);
+	else if (!strcmp(argv[i], "-n") && ((i + 1) < argc))
+		count = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-k") && ((i + 1) < argc))
+		mean = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-a") && ((i + 1) < argc))
+		archives = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-e") && ((i + 1) < argc))
+		entries_no = atoi(argv[++i]);
+	else if ((argv[i][0] != '-') && (dir == NULL))
+		dir = argv[i];
+	else {
+		dir = NULL;
+		break;
+	}
+    }
+
+    if ((dir == NULL) || (count < 0) || (mean < 1) || (archives < 0) || (entries_no < 1)) {
+	printf("Usage: corp_gen [-s SEED] [-n FILES] [-k KB] [-a ARCHIVES] [-e ENTRIES] DIRECTORY\n\n");
+	printf("-s: Seed (default 1)\n");
+	printf("-n: Number of files of each class (default 8)\n");
+	printf("-k: Mean file size in KB (default 64); archive entries average a quarter of it\n");
+	printf("-a: Number of HQR archives (default 2)\n");
+	printf("-e: Number of entries per archive (default 64)\n");
+	return 1;
+    }
+
+    mean <<= 10;
+
+    make_dir(dir);
+    path = (char *) malloc(strlen(dir) + 32);
+    memset(&b, 0x00, sizeof(gen_buf_t));
+
+    for (c = 0; c < NUM_CLASSES; c++) {
+	bytes = 0;
+	for (i = 0; i < count; i++) {
+		rng_seed(seed, c, i);
+		b.len = 0;
+		class_funcs[c](&b, gen_size(mean));
+		sprintf(path, "%s/%s%04i.%s", dir, class_names[c], i, class_names[c]);
+		if (!write_file(path, b.data, b.len))
+			ret = 2;
+		bytes += b.len;
+	}
+	if (count > 0)
+		printf("%4i x %s: %i bytes\n", count, class_names[c], bytes);
+    }
+
+    memset(stats, 0x00, sizeof(stats));
+    for (i = 0; i < archives; i++) {
+	rng_seed(seed, NUM_CLASSES, i);
+	sprintf(path, "%s/arch%04i.hqr", dir, i);
+	if (!gen_archive(path, entries_no, mean >> 2, stats))
+		ret = 2;
+    }
+    if (archives > 0)
+	printf("%4i x hqr: %i bytes, %i normal, %i NULL, %i pointer and %i child entries\n",
+	       archives, stats[4], stats[3], stats[0], stats[1], stats[2]);
+
+    free(b.data);
+    free(path);
+
+    return ret;
+}
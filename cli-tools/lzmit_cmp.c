@@ -0,0 +1,130 @@
+/* Compares the reworked LZMIT tree engine against the original one: both
+   are run over every file given on the command line, their outputs are
+   checked to be byte-identical and their throughput is reported. */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include <lbatools/compress.h>
+
+
+static double
+get_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    return (double) now.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + ((double) ts.tv_nsec / 1000000000.0);
+#endif
+}
+
+
+/* Runs the engine over the buffer until at least min_time seconds have
+   passed and returns the throughput in MB/s. */
+static double
+run_engine(comp_ctx_t *ctx, int engine, char *out, char *in, int32_t in_len, int32_t *out_len)
+{
+    double start, elapsed, min_time = 0.5;
+    int runs = 0;
+
+    comp_ctx_set_engine(ctx, engine);
+
+    start = get_time();
+    do {
+	*out_len = compress_ctx(ctx, 2, out, in, in_len);
+	runs++;
+	elapsed = get_time() - start;
+    } while (elapsed < min_time);
+
+    return ((double) in_len * (double) runs) / (elapsed * 1048576.0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i, ret = 0;
+    int32_t in_len, ref_len, new_len;
+    double ref_mbs, new_mbs;
+    double ref_total = 0.0, new_total = 0.0;
+    comp_ctx_t *ctx;
+    FILE *f;
+    char *in, *ref_out, *new_out;
+
+    printf("LBA LZMIT Engine Comparison Program\n\n");
+
+    if (argc < 2) {
+	printf("Usage: lzmit_cmp FILENAME.EXT [FILENAME.EXT ...]\n");
+	return 1;
+    }
+
+    ctx = comp_ctx_new();
+    if (ctx == NULL) {
+	printf("Unable to allocate the encoder context\n");
+	return 2;
+    }
+
+    printf("%-32s %10s %10s %10s %8s\n", "File", "Size", "Ref MB/s", "New MB/s", "Speedup");
+
+    for (i = 1; i < argc; i++) {
+	f = fopen(argv[i], "rb");
+	if (f == NULL) {
+		printf("File does not exist: %s\n", argv[i]);
+		ret = 3;
+		continue;
+	}
+
+	fseek(f, 0, SEEK_END);
+	in_len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	/* The reference engine reads up to a look ahead buffer past the end
+	   of the input, pad it with zeroes like the new engine assumes. */
+	in = (char *) calloc(in_len + 32, 1);
+	fread(in, 1, in_len, f);
+	fclose(f);
+
+	ref_out = (char *) malloc((in_len << 1) + 32);
+	new_out = (char *) malloc((in_len << 1) + 32);
+
+	ref_mbs = run_engine(ctx, COMP_ENGINE_TREE_REF, ref_out, in, in_len, &ref_len);
+	new_mbs = run_engine(ctx, COMP_ENGINE_TREE, new_out, in, in_len, &new_len);
+
+	ref_total += (double) in_len / ref_mbs;
+	new_total += (double) in_len / new_mbs;
+
+	printf("%-32s %10i %10.2f %10.2f %7.2fx\n", argv[i], in_len, ref_mbs, new_mbs, new_mbs / ref_mbs);
+
+	if ((ref_len != new_len) || ((ref_len > 0) && memcmp(ref_out, new_out, ref_len))) {
+		printf("    MISMATCH: reference gave %i bytes, new engine gave %i bytes\n", ref_len, new_len);
+		ret = 4;
+	}
+
+	free(new_out);
+	free(ref_out);
+	free(in);
+    }
+
+    if (new_total > 0.0)
+	printf("\nOverall speedup: %.2fx\n", ref_total / new_total);
+
+    comp_ctx_free(ctx);
+
+    return ret;
+}
@@ -8,6 +8,146 @@
 #include <string.h>
 
 #include <lbatools/compress.h>
+#include "lz.h"
+
+
+comp_ctx_t *
+comp_ctx_new(void)
+{
+    comp_ctx_t *ctx = (comp_ctx_t *) malloc(sizeof(comp_ctx_t));
+
+    if (ctx != NULL) {
+	memset(ctx, 0x00, sizeof(comp_ctx_t));
+	ctx->engine = COMP_ENGINE_TREE;
+	ctx->parse = COMP_PARSE_GREEDY;
+	ctx->chain_limit = LZ_CHAIN_LIMIT;
+	ctx->scan_threshold = COMP_SCAN_OFF;
+    }
+
+    return ctx;
+}
+
+
+void
+comp_ctx_free(comp_ctx_t *ctx)
+{
+    if (ctx == NULL)
+	return;
+
+    if (ctx->lzss != NULL)
+	lzss_state_free(ctx->lzss);
+
+    if (ctx->lzmit != NULL)
+	lzmit_state_free(ctx->lzmit);
+
+    if (ctx->hash != NULL)
+	lz_hash_free(ctx->hash);
+
+    if (ctx->bt != NULL)
+	lz_bt_free(ctx->bt);
+
+    lz_opt_free(&ctx->opt);
+
+    free(ctx);
+}
+
+
+void
+comp_ctx_set_engine(comp_ctx_t *ctx, int engine)
+{
+    if ((engine >= COMP_ENGINE_TREE) && (engine <= COMP_ENGINE_TREE_REF))
+	ctx->engine = engine;
+}
+
+
+/* Selects how the LZ encoders pick their tokens. The optimal parse ignores
+   the engine setting, it always uses its own binary tree match finder. */
+void
+comp_ctx_set_parse(comp_ctx_t *ctx, int parse)
+{
+    if ((parse == COMP_PARSE_GREEDY) || (parse == COMP_PARSE_OPTIMAL))
+	ctx->parse = parse;
+}
+
+
+/* Maximum number of chain links the hash engine follows for each position,
+   0 means no limit other than the 4 KB window. */
+void
+comp_ctx_set_chain_limit(comp_ctx_t *ctx, int32_t limit)
+{
+    ctx->chain_limit = (limit < 0) ? 0 : limit;
+}
+
+
+/* Maximum number of nodes the tree engine visits for each position, 0
+   means no limit. Past the limit the rest of the branch is dropped from
+   the tree, so this bounds the worst case at some cost in ratio. */
+void
+comp_ctx_set_depth_limit(comp_ctx_t *ctx, int32_t limit)
+{
+    ctx->depth_limit = (limit < 0) ? 0 : limit;
+}
+
+
+/* Whether the hash engine defers a match by one byte when the next one is
+   longer. */
+void
+comp_ctx_set_lazy(comp_ctx_t *ctx, int lazy)
+{
+    ctx->lazy = !!lazy;
+}
+
+
+/* Threshold of the incompressibility pre-scan, in per mille of the input:
+   if the sampled bytes have a high entropy and the quick parse of them
+   comes out at this size or more, the LZ encoders give up at once, as if
+   they had run out of room. COMP_SCAN_OFF, which new contexts start
+   with, turns the pre-scan off. */
+void
+comp_ctx_set_scan(comp_ctx_t *ctx, int32_t threshold)
+{
+    ctx->scan_threshold = (threshold < 0) ? COMP_SCAN_OFF : threshold;
+}
+
+
+/* What each compression level does: which engine and parser it uses, how
+   many chain links a search may follow (0 for no limit) and whether
+   matches are taken lazily. Level 0 is what a new context does, the
+   original encoders. */
+static const struct {
+    int		engine, parse, lazy;
+    int32_t	chain_limit;
+} comp_levels[COMP_LEVEL_BEST + 1] = {
+    { COMP_ENGINE_TREE, COMP_PARSE_GREEDY,  0, LZ_CHAIN_LIMIT },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  0,              4 },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  0,              8 },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  0,             16 },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  1,             16 },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  1,             32 },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  1,             64 },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  1,            128 },
+    { COMP_ENGINE_HASH, COMP_PARSE_GREEDY,  1,            256 },
+    { COMP_ENGINE_TREE, COMP_PARSE_OPTIMAL, 0, LZ_CHAIN_LIMIT }
+};
+
+
+/* Sets the engine, parser and search limits at once from a level between
+   COMP_LEVEL_DEFAULT and COMP_LEVEL_BEST; out of range levels are clamped.
+   The tree depth limit goes back to none. */
+void
+comp_ctx_set_level(comp_ctx_t *ctx, int level)
+{
+    if (level < COMP_LEVEL_DEFAULT)
+	level = COMP_LEVEL_DEFAULT;
+    else if (level > COMP_LEVEL_BEST)
+	level = COMP_LEVEL_BEST;
+
+    ctx->engine = comp_levels[level].engine;
+    ctx->parse = comp_levels[level].parse;
+    ctx->lazy = comp_levels[level].lazy;
+    ctx->chain_limit = comp_levels[level].chain_limit;
+    ctx->depth_limit = 0;
+}
 
 
 int32_t
@@ -19,54 +159,176 @@ compress_store(char *output, char *input, int32_t length)
 
 
 int32_t
-compress_lz(int16_t type, char *output, char *input, int32_t length)
+compress_lz_ctx(comp_ctx_t *ctx, int16_t type, char *output, char *input, int32_t length)
 {
+    if (((type == 1) || (type == 2)) &&
+	lz_scan_incompressible(type, (uint8_t *) input, length, ctx->scan_threshold))
+	return lz_out_fail(type, length);
+
     switch (type) {
 	case 1:		/* LZSS */
-		return compress_lzss(output, input, length);
+		return compress_lzss_ctx(ctx, output, input, length);
 	case 2:		/* LZMIT */
-		return compress_lzmit(output, input, length);
+		return compress_lzmit_ctx(ctx, output, input, length);
 	default:	/* Invalid */
 		return -1;
     }
 }
 
 
+/* The context-less entry points use a temporary context for every call,
+   which keeps them safe to call from several threads at once. Callers that
+   compress many buffers should keep a context around instead. */
+int32_t
+compress_lz(int16_t type, char *output, char *input, int32_t length)
+{
+    comp_ctx_t *ctx;
+    int32_t ret;
+
+    ctx = comp_ctx_new();
+    if (ctx == NULL)
+	return -1;
+
+    ret = compress_lz_ctx(ctx, type, output, input, length);
+
+    comp_ctx_free(ctx);
+
+    return ret;
+}
+
+
+int32_t
+compress_level(int16_t type, int level, char *output, char *input, int32_t length)
+{
+    comp_ctx_t *ctx;
+    int32_t ret;
+
+    ctx = comp_ctx_new();
+    if (ctx == NULL)
+	return -1;
+
+    comp_ctx_set_level(ctx, level);
+    ret = compress_ctx(ctx, type, output, input, length);
+
+    comp_ctx_free(ctx);
+
+    return ret;
+}
+
+
+int32_t
+compress_lzss(char *output, char *input, int32_t length)
+{
+    return compress_lz(1, output, input, length);
+}
+
+
+int32_t
+compress_lzmit(char *output, char *input, int32_t length)
+{
+    return compress_lz(2, output, input, length);
+}
+
+
+/* Copies a match of len bytes from dist bytes back. Matches are at most
+   18 bytes long, so every case is a couple of fixed size moves: two
+   overlapping chunks when the source is entirely behind the destination,
+   a splatted pattern for the distances that divide a word (including the
+   distance of 1 that offset 0 codes), and 8-byte steps for the rest as
+   long as every step only reads bytes that are already written. */
+static __inline void
+lz_copy_match(uint8_t *dst, int32_t dist, int32_t len)
+{
+    const uint8_t *src = dst - dist;
+    uint64_t v;
+    uint32_t v32;
+    uint16_t v16;
+    int32_t k;
+
+    if (dist >= len) {
+	if (len >= 16) {
+		memcpy(dst, src, 16);
+		memcpy(dst + len - 16, src + len - 16, 16);
+	} else if (len >= 8) {
+		memcpy(dst, src, 8);
+		memcpy(dst + len - 8, src + len - 8, 8);
+	} else if (len >= 4) {
+		memcpy(dst, src, 4);
+		memcpy(dst + len - 4, src + len - 4, 4);
+	} else {
+		memcpy(dst, src, 2);
+		dst[len - 1] = src[len - 1];
+	}
+	return;
+    }
+
+    switch (dist) {
+	case 1:
+		memset(dst, src[0], len);
+		return;
+	case 2:
+		memcpy(&v16, src, 2);
+		v = v16 * 0x0001000100010001ULL;
+		break;
+	case 4:
+		memcpy(&v32, src, 4);
+		v = v32 * 0x0000000100000001ULL;
+		break;
+	case 3: case 5: case 6: case 7:
+		for (k = 0; k < len; k++)
+			dst[k] = src[k];
+		return;
+	default:
+		for (k = 0; (k + 8) <= len; k += 8)
+			memcpy(dst + k, src + k, 8);
+		if (k < len)
+			memcpy(dst + len - 8, src + len - 8, 8);
+		return;
+    }
+
+    for (k = 0; (k + 8) <= len; k += 8)
+	memcpy(dst + k, &v, 8);
+    if (k < len)
+	memcpy(dst + k, &v, len - k);
+}
+
+
+/* Tokens are read as unsigned bytes; the original decoder read them
+   through a (signed) char, which broke every match whose low byte had
+   the top bit set on targets where char is signed. */
 int32_t
 decompress_lz(int16_t type, char *output, char *input, int32_t length)
 {
-    int32_t i = 0, j = 0, k = 0, offset, match_len, ptr, n, temp;
-    uint8_t bits, in_byte;
+    const uint8_t *in = (const uint8_t *) input;
+    uint8_t *out = (uint8_t *) output;
+    int32_t i = 0, j = 0, offset, match_len, n;
+    int32_t bias = (int32_t) (type + 1);
+    uint8_t bits;
 
     while (i < length) {
-	in_byte = input[i++];
+	bits = in[i++];
+
+	/* A flag byte of all ones is a run of eight literals. */
+	if ((bits == 0xff) && ((i + 8) <= length)) {
+		memcpy(out + j, in + i, 8);
+		i += 8;
+		j += 8;
+
+		if (i >= length)
+			return j;
+		continue;
+	}
 
-	for (bits = 1; bits != 0; bits <<= 1) {
-		if ((in_byte & bits) != 0)
-			output[j++] = input[i++];
+	for (n = 8; n > 0; n--, bits >>= 1) {
+		if (bits & 1)
+			out[j++] = in[i++];
 		else {
-                        offset = ((int32_t) input[i]) | ((int) (input[i + 1] << 8));
-			match_len = (offset & 0x0f) + (int32_t)(type + 1);
+			offset = in[i] | (in[i + 1] << 8);
+			match_len = (offset & 0x0f) + bias;
 
 			i += 2;
-			offset >>= 4;
-
-			ptr = j - offset - 1;
-
-			if (offset == 0) {
-				for (k = 0; k < match_len; k++)
-					output[j + k] = output[ptr];
-			} else {
-				if ((ptr + match_len) >= j) {
-					temp = j;
-					for (n = match_len; n > 0; n--)
-					output[temp++] = output[ptr++];
-				} else {
-					for (k = 0; k < match_len; k++)
-						output[j + k] = output[ptr + k];
-				}
-			}
 
+			lz_copy_match(out + j, (offset >> 4) + 1, match_len);
 			j += match_len;
 		}
 
@@ -79,6 +341,161 @@ decompress_lz(int16_t type, char *output, char *input, int32_t length)
 }
 
 
+int32_t
+compress_ctx(comp_ctx_t *ctx, int16_t type, char *output, char *input, int32_t length)
+{
+    switch (type) {
+	case 0:		/* Store */
+		return compress_store(output, input, length);
+	case 1:		/* LZSS */
+	case 2:		/* LZMIT */
+		return compress_lz_ctx(ctx, type, output, input, length);
+	default:	/* Invalid */
+		return -1;
+    }
+}
+
+
+/* Size of the largest stream an encoder can write for length bytes, which
+   is every byte coded as a literal plus a flag byte for every eight. A
+   buffer of this size can take the output of any of the compress*()
+   functions and of the streaming encoder. Returns -1 if that does not fit
+   in an int32_t. */
+int32_t
+compress_bound(int16_t type, int32_t length)
+{
+    if (length < 0)
+	return -1;
+
+    switch (type) {
+	case 0:		/* Store */
+		return length;
+	case 1:		/* LZSS */
+	case 2:		/* LZMIT */
+		if (length > (INT32_MAX - (length >> 3) - 1))
+			return -1;
+		return length + ((length + 7) >> 3);
+	default:	/* Invalid */
+		return -1;
+    }
+}
+
+
+/* Compresses into a buffer of out_size bytes. Returns the compressed size,
+   or -1 if the data does not fit or, for the LZ types, does not get any
+   smaller, in which case the caller should store it instead. Unlike
+   compress(), this never writes past out_size, however small it is. */
+int32_t
+compress_safe_ctx(comp_ctx_t *ctx, int16_t type, char *output, int32_t out_size, char *input, int32_t length)
+{
+    int32_t ret, limit;
+
+    if (length == 0)
+	return 0;
+
+    if (type == 0)
+	return (out_size >= length) ? compress_store(output, input, length) : -1;
+
+    if ((type != 1) && (type != 2))
+	return -1;
+
+    if (out_size <= LZ_OUT_SLACK)
+	return -1;
+
+    ctx->out_size = out_size;
+    limit = lz_out_limit(ctx, type, length);
+    ret = compress_lz_ctx(ctx, type, output, input, length);
+    ctx->out_size = 0;
+
+    /* LZSS reports a failure as the limit or the input length, LZMIT as
+       -1; a real stream is always below the limit. */
+    if ((ret < 0) || ((type == 1) && (ret >= limit)))
+	return -1;
+
+    return ret;
+}
+
+
+int32_t
+compress_safe(int16_t type, char *output, int32_t out_size, char *input, int32_t length)
+{
+    comp_ctx_t *ctx;
+    int32_t ret;
+
+    ctx = comp_ctx_new();
+    if (ctx == NULL)
+	return -1;
+
+    ret = compress_safe_ctx(ctx, type, output, out_size, input, length);
+
+    comp_ctx_free(ctx);
+
+    return ret;
+}
+
+
+/* Every input goes through compress_safe_ctx() with a capacity of its own
+   length, so an LZ output is always smaller than the stored one would be.
+   The tree engines only clear the part of their state the previous input
+   used, so a context costs about the same for each small input as for
+   one big one of the same total size. */
+int32_t
+compress_batch_ctx(comp_ctx_t *ctx, int16_t type, const comp_span_t *inputs, int32_t count,
+		   char *arena, int32_t arena_size, int32_t *offsets, int16_t *types)
+{
+    int32_t i, len, out_size, pos = 0;
+    int16_t t;
+
+    if ((type < 0) || (type > 2))
+	return -1;
+
+    for (i = 0; i < count; i++) {
+	offsets[i] = pos;
+
+	out_size = arena_size - pos;
+	if (out_size > inputs[i].length)
+		out_size = inputs[i].length;
+
+	t = type;
+	len = ((t == 0) || (inputs[i].length == 0)) ? -1 : compress_safe_ctx(ctx, t, arena + pos, out_size, inputs[i].data, inputs[i].length);
+	if (len < 0) {
+		if ((arena_size - pos) < inputs[i].length)
+			return -1;
+
+		t = 0;
+		len = compress_store(arena + pos, inputs[i].data, inputs[i].length);
+	}
+
+	if (types != NULL)
+		types[i] = t;
+	pos += len;
+    }
+
+    offsets[count] = pos;
+
+    return pos;
+}
+
+
+int32_t
+compress_batch(int16_t type, const comp_span_t *inputs, int32_t count,
+	       char *arena, int32_t arena_size, int32_t *offsets, int16_t *types)
+{
+    comp_ctx_t *ctx;
+    int32_t ret;
+
+    ctx = comp_ctx_new();
+    if (ctx == NULL)
+	return -1;
+
+    ret = compress_batch_ctx(ctx, type, inputs, count, arena, arena_size, offsets, types);
+
+    comp_ctx_free(ctx);
+
+    return ret;
+}
+
+
 int32_t
 compress(int16_t type, char *output, char *input, int32_t length)
 {
@@ -94,6 +511,131 @@ compress(int16_t type, char *output, char *input, int32_t length)
 }
 
 
+/* Bounds checked decoder. The output never goes past out_size and never
+   refers to data before its start, and a stream that ends in the middle
+   of a token is an error. When decoding in place, the input lives at gap
+   bytes into the output buffer, and every token must leave the output no
+   further than the input bytes still to be read; gap is -1 otherwise.
+   Returns the decompressed size, or -1 for any of those errors. */
+static int32_t
+lz_decode_safe(int16_t type, uint8_t *out, int32_t out_size, const uint8_t *in, int32_t length, int32_t gap)
+{
+    int32_t i = 0, j = 0, offset, dist, match_len, n;
+    int32_t bias = (int32_t) (type + 1);
+    uint8_t bits;
+
+    if (gap < 0)
+	gap = out_size;
+
+    while (i < length) {
+	bits = in[i++];
+
+	/* A flag byte with no tokens after it ends the stream. */
+	if (i >= length)
+		return j;
+
+	/* Literal runs use memmove(), since in place the two may overlap. */
+	if ((bits == 0xff) && ((i + 8) <= length) && ((j + 8) <= out_size) && (j <= (gap + i))) {
+		memmove(out + j, in + i, 8);
+		i += 8;
+		j += 8;
+
+		if (i >= length)
+			return j;
+		continue;
+	}
+
+	for (n = 8; n > 0; n--, bits >>= 1) {
+		if (bits & 1) {
+			if ((j >= out_size) || (j > (gap + i)))
+				return -1;
+			out[j++] = in[i++];
+		} else {
+			if ((i + 2) > length)
+				return -1;
+
+			offset = in[i] | (in[i + 1] << 8);
+			dist = (offset >> 4) + 1;
+			match_len = (offset & 0x0f) + bias;
+
+			i += 2;
+
+			if ((dist > j) || ((j + match_len) > out_size) || ((j + match_len) > (gap + i)))
+				return -1;
+
+			lz_copy_match(out + j, dist, match_len);
+			j += match_len;
+		}
+
+		if (i >= length)
+			return j;
+	}
+    }
+
+    return j;
+}
+
+
+int32_t
+decompress_lz_safe(int16_t type, char *output, int32_t out_size, char *input, int32_t length)
+{
+    return lz_decode_safe(type, (uint8_t *) output, out_size, (const uint8_t *) input, length, -1);
+}
+
+
+int32_t
+decompress_safe(int16_t type, char *output, int32_t out_size, char *input, int32_t length)
+{
+    switch (type) {
+	case 0:		/* Store */
+		if (length > out_size)
+			return -1;
+		return decompress_store(output, input, length);
+	case 1:		/* LZSS */
+	case 2:		/* LZMIT */
+		return decompress_lz_safe(type, output, out_size, input, length);
+	default:	/* Invalid */
+		return -1;
+    }
+}
+
+
+/* Extra room in-place decompression needs past the decompressed size. The
+   input can only get ahead of the output by the flag bytes that are still
+   to come, since every token makes at least as many bytes as it takes. */
+int32_t
+decompress_margin(int16_t type, int32_t dec_size)
+{
+    return (type == 0) ? 0 : ((dec_size + 7) >> 3);
+}
+
+
+/* Decompresses comp_size bytes of compressed data found at the end of buf
+   into the start of the same buffer. With buf_size at least the
+   decompressed size plus decompress_margin() this always works; with less
+   it may still work, and fails cleanly before overwriting unread input
+   when it does not. */
+int32_t
+decompress_in_place(int16_t type, char *buf, int32_t buf_size, int32_t comp_size)
+{
+    int32_t gap = buf_size - comp_size;
+
+    if ((comp_size < 0) || (gap < 0))
+	return -1;
+
+    switch (type) {
+	case 0:		/* Store */
+		memmove(buf, buf + gap, comp_size);
+		return comp_size;
+	case 1:		/* LZSS */
+	case 2:		/* LZMIT */
+		return lz_decode_safe(type, (uint8_t *) buf, buf_size, (const uint8_t *) buf + gap, comp_size, gap);
+	default:	/* Invalid */
+		return -1;
+    }
+}
+
+
 int32_t
 decompress(int16_t type, char *output, char *input, int32_t length)
 {
@@ -0,0 +1,225 @@
+/* Push-style streaming encoder for all compression types. Input is taken
+   in chunks of any size and the compressed stream is handed to a write
+   callback as it is produced, so the memory used is constant no matter
+   how large the input is: a buffer of CS_BUF_SIZE bytes that slides
+   forward keeping the last LZ_MAX_DIST bytes as history, the hash chain
+   match finder, and an output buffer of CS_OUT_SIZE bytes.
+
+   The LZ types are parsed with the same greedy hash chain parser as the
+   COMP_ENGINE_HASH engine, so the stream is byte-identical to what
+   compress_ctx() makes with that engine - except that a stream never
+   gives up on incompressible data, since it can not go back and store. */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include "lz.h"
+
+
+#define CS_BUF_SIZE		(128 * 1024)
+#define CS_OUT_SIZE		(64 * 1024)
+#define CS_OUT_SLACK		64
+
+
+struct comp_stream_t
+{
+    int16_t		type;
+    int32_t		chain_limit;
+
+    comp_write_t	write;
+    void *		priv;
+
+    lz_hash_t *		hash;
+    lz_out_t		out;
+    int64_t		total;
+    int			error;
+
+    int32_t		pos, end;		/* Next position to parse, end of data. */
+
+    uint8_t		buf[CS_BUF_SIZE];
+    uint8_t		out_buf[CS_OUT_SIZE];
+};
+
+
+comp_stream_t *
+comp_stream_new(int16_t type, comp_write_t write, void *priv)
+{
+    comp_stream_t *cs;
+
+    if ((type < 0) || (type > 2) || (write == NULL))
+	return NULL;
+
+    cs = (comp_stream_t *) malloc(sizeof(comp_stream_t));
+    if (cs == NULL)
+	return NULL;
+
+    memset(cs, 0x00, offsetof(comp_stream_t, buf));
+
+    cs->type = type;
+    cs->chain_limit = LZ_CHAIN_LIMIT;
+    cs->write = write;
+    cs->priv = priv;
+
+    if (type != 0) {
+	cs->hash = lz_hash_new();
+	if (cs->hash == NULL) {
+		free(cs);
+		return NULL;
+	}
+    }
+
+    lz_out_init(&cs->out, cs->out_buf);
+
+    return cs;
+}
+
+
+void
+comp_stream_free(comp_stream_t *cs)
+{
+    if (cs == NULL)
+	return;
+
+    if (cs->hash != NULL)
+	lz_hash_free(cs->hash);
+
+    free(cs);
+}
+
+
+/* Same meaning as comp_ctx_set_chain_limit(); set it before the first
+   write for the output to match compress_ctx() with the same setting. */
+void
+comp_stream_set_chain_limit(comp_stream_t *cs, int32_t limit)
+{
+    cs->chain_limit = (limit < 0) ? 0 : limit;
+}
+
+
+static int
+cs_emit(comp_stream_t *cs, const uint8_t *data, int32_t len)
+{
+    if ((len > 0) && !cs->error) {
+	if (cs->write(cs->priv, (const char *) data, len) != len)
+		cs->error = 1;
+	else
+		cs->total += len;
+    }
+
+    return !cs->error;
+}
+
+
+/* Hands everything before the flag byte that is still being filled to the
+   write callback, and moves that flag byte and its tokens to the front. */
+static int
+cs_flush(comp_stream_t *cs)
+{
+    lz_out_t *out = &cs->out;
+    int32_t done = out->flag_pos;
+
+    if (!cs_emit(cs, out->buf, done))
+	return 0;
+
+    memmove(out->buf, out->buf + done, out->pos - done);
+    out->pos -= done;
+    out->flag_pos = 0;
+
+    return 1;
+}
+
+
+/* Parses up to stop, flushing the output often enough that it never runs
+   out of room - a chunk of CS_OUT_SLACK positions can not make more than
+   CS_OUT_SLACK * 9 / 8 bytes, plus a token running past the chunk. */
+static int
+cs_parse(comp_stream_t *cs, int32_t stop)
+{
+    int32_t next;
+
+    while (cs->pos < stop) {
+	next = cs->pos + CS_OUT_SLACK;
+	if (next > stop)
+		next = stop;
+
+	cs->pos = lz_parse_greedy(cs->hash, cs->chain_limit, 0, cs->type, &cs->out,
+				  cs->buf, cs->pos, next, cs->end, INT32_MAX);
+
+	if ((cs->out.pos > (CS_OUT_SIZE - (CS_OUT_SLACK * 2) - LZ_MAX_MATCH(2))) && !cs_flush(cs))
+		return 0;
+    }
+
+    return 1;
+}
+
+
+/* Feeds length bytes of input to the stream. Returns 0, or -1 if the write
+   callback failed. */
+int32_t
+comp_stream_write(comp_stream_t *cs, const char *input, int32_t length)
+{
+    int32_t n, shift;
+
+    if (cs->error)
+	return -1;
+
+    if (cs->type == 0)
+	return cs_emit(cs, (const uint8_t *) input, length) ? 0 : -1;
+
+    while (length > 0) {
+	if (cs->end == CS_BUF_SIZE) {
+		/* Slide the buffer, keeping a whole window of history. The
+		   shift is a multiple of the window so that the chains keep
+		   their slots. */
+		shift = (cs->pos - LZ_MAX_DIST) & ~(LZ_MAX_DIST - 1);
+		memmove(cs->buf, cs->buf + shift, cs->end - shift);
+		lz_hash_rebase(cs->hash, shift);
+		cs->pos -= shift;
+		cs->end -= shift;
+	}
+
+	n = CS_BUF_SIZE - cs->end;
+	if (n > length)
+		n = length;
+
+	memcpy(cs->buf + cs->end, input, n);
+	cs->end += n;
+	input += n;
+	length -= n;
+
+	/* Only parse positions that have a full look ahead behind them,
+	   the rest has to wait for more input or for the end. */
+	if (!cs_parse(cs, cs->end - LZ_MAX_MATCH(cs->type)))
+		return -1;
+    }
+
+    return 0;
+}
+
+
+/* Encodes whatever input is left and flushes the output. Returns the total
+   size of the compressed stream, or -1 if the write callback failed. The
+   stream can not be written to afterwards. */
+int64_t
+comp_stream_finish(comp_stream_t *cs)
+{
+    if (cs->error)
+	return -1;
+
+    if (cs->type != 0) {
+	if (!cs_parse(cs, cs->end))
+		return -1;
+
+	cs->out.pos = lz_out_finish(&cs->out);
+	cs->out.flag_pos = cs->out.pos;
+	if (!cs_flush(cs))
+		return -1;
+    }
+
+    return cs->total;
+}
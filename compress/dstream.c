@@ -0,0 +1,161 @@
+/* Resumable streaming decoder for all compression types. Input is taken
+   in chunks of any size and output is written to a bounded buffer that
+   the caller supplies, so neither the whole compressed entry nor the
+   whole decompressed entry has to be in memory at once. Decoding can
+   stop anywhere - between the two bytes of a match token, or halfway
+   through copying a match - and picks up where it left off on the next
+   call. The only history kept is the last LZ_MAX_DIST bytes of output,
+   which is as far back as a match can reach. */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include "lz.h"
+
+
+#define MOD_DIST(a)		((a) & (LZ_MAX_DIST - 1))
+
+
+struct decomp_stream_t
+{
+    int16_t	type;
+
+    uint8_t	flags;			/* Current flag byte, shifted. */
+    int		bits;			/* Flag bits left in it. */
+    int		have_lo;		/* Low byte of a match token read. */
+    uint8_t	lo;
+
+    int32_t	match_len, match_dist;	/* Match still being copied. */
+
+    int32_t	pos;			/* Output position, modulo the ring. */
+    int32_t	filled;			/* Valid history, up to LZ_MAX_DIST. */
+    uint8_t	hist[LZ_MAX_DIST];
+};
+
+
+decomp_stream_t *
+decomp_stream_new(int16_t type)
+{
+    decomp_stream_t *ds;
+
+    if ((type < 0) || (type > 2))
+	return NULL;
+
+    ds = (decomp_stream_t *) malloc(sizeof(decomp_stream_t));
+    if (ds != NULL)
+	decomp_stream_reset(ds, type);
+
+    return ds;
+}
+
+
+/* Gets the stream ready for a new entry, possibly of another type. */
+void
+decomp_stream_reset(decomp_stream_t *ds, int16_t type)
+{
+    ds->type = type;
+    ds->flags = 0x00;
+    ds->bits = 0;
+    ds->have_lo = 0;
+    ds->lo = 0x00;
+    ds->match_len = ds->match_dist = 0;
+    ds->pos = ds->filled = 0;
+}
+
+
+void
+decomp_stream_free(decomp_stream_t *ds)
+{
+    free(ds);
+}
+
+
+static __inline void
+put_byte(decomp_stream_t *ds, uint8_t *out, int32_t *o, uint8_t val)
+{
+    out[(*o)++] = val;
+    ds->hist[ds->pos] = val;
+    ds->pos = MOD_DIST(ds->pos + 1);
+}
+
+
+/* Decodes as much of input as fits into output. *in_used gets the number of
+   input bytes consumed, which is less than in_len only if the output is
+   full. Returns the number of bytes written to output, or -1 if the stream
+   is corrupt (a match that reaches back before the start of the data). */
+int32_t
+decomp_stream_run(decomp_stream_t *ds, const char *input, int32_t in_len, int32_t *in_used,
+		  char *output, int32_t out_size)
+{
+    const uint8_t *in = (const uint8_t *) input;
+    uint8_t *out = (uint8_t *) output;
+    int32_t i = 0, o = 0, n, val;
+
+    if (ds->type == 0) {
+	n = (in_len < out_size) ? in_len : out_size;
+	memcpy(out, in, n);
+	*in_used = n;
+	return n;
+    }
+
+    while (1) {
+	/* Finish any match that was cut short by a full output buffer. */
+	while (ds->match_len > 0) {
+		if (o >= out_size)
+			goto done;
+		put_byte(ds, out, &o, ds->hist[MOD_DIST(ds->pos - ds->match_dist)]);
+		ds->match_len--;
+	}
+
+	if (ds->bits == 0) {
+		if (i >= in_len)
+			goto done;
+		ds->flags = in[i++];
+		ds->bits = 8;
+	}
+
+	if (ds->flags & 1) {
+		if ((i >= in_len) || (o >= out_size))
+			goto done;
+		put_byte(ds, out, &o, in[i++]);
+		if (ds->filled < LZ_MAX_DIST)
+			ds->filled++;
+	} else {
+		if (!ds->have_lo) {
+			if (i >= in_len)
+				goto done;
+			ds->lo = in[i++];
+			ds->have_lo = 1;
+		}
+		if (i >= in_len)
+			goto done;
+
+		val = ds->lo | (in[i++] << 8);
+		ds->have_lo = 0;
+
+		ds->match_len = (val & 0x0f) + (int32_t) (ds->type + 1);
+		ds->match_dist = (val >> 4) + 1;
+
+		if (ds->match_dist > ds->filled) {
+			*in_used = i;
+			return -1;
+		}
+
+		ds->filled += ds->match_len;
+		if (ds->filled > LZ_MAX_DIST)
+			ds->filled = LZ_MAX_DIST;
+	}
+
+	ds->flags >>= 1;
+	ds->bits--;
+    }
+
+done:
+    *in_used = i;
+
+    return o;
+}
@@ -0,0 +1,294 @@
+/* Internal definitions shared by the LZ encoders. Not part of the public
+   API - everything a caller needs is in <lbatools/compress.h>. */
+#ifndef LBATOOLS_LZ_H
+# define LBATOOLS_LZ_H
+
+
+/* Parameters of the token format, common to both LZ types: a 12-bit
+   distance and a 4-bit length, where the length bias depends on the type
+   (2 for LZSS, 3 for LZMIT). */
+#define LZ_INDEX_BIT_COUNT	12
+#define LZ_LENGTH_BIT_COUNT	4
+#define LZ_MAX_DIST		(1 << LZ_INDEX_BIT_COUNT)
+#define LZ_MIN_MATCH(t)		((t) + 1)
+#define LZ_MAX_MATCH(t)		((1 << LZ_LENGTH_BIT_COUNT) + (t))
+
+#define LZ_HASH_BITS		16
+#define LZ_HASH_SIZE		(1 << LZ_HASH_BITS)
+#define LZ_HASH_KEY(p)		((p)[0] | ((p)[1] << 8))
+#define LZ_CHAIN_LIMIT		32
+#define LZ_BT_SIZE		(LZ_MAX_DIST << 1)
+
+
+typedef struct lzss_state_t	lzss_state_t;
+typedef struct lzmit_state_t	lzmit_state_t;
+
+
+/* Hash chain match finder. The heads are keyed on the first two bytes of
+   a string, which is the shortest match either type can code, and the
+   chains are a ring of LZ_MAX_DIST links indexed by position. */
+typedef struct
+{
+    int32_t	head[LZ_HASH_SIZE];
+    int32_t	prev[LZ_MAX_DIST];
+} lz_hash_t;
+
+
+/* Binary tree match finder, as used by the optimal parser. There is one
+   tree per two-byte key, and the nodes are a ring of positions twice the
+   window size, so a node within reach never shares a slot with the node
+   being inserted. Every search returns the longest match in the window. */
+typedef struct
+{
+    int32_t	head[LZ_HASH_SIZE];
+    int32_t	left[LZ_BT_SIZE], right[LZ_BT_SIZE];
+} lz_bt_t;
+
+
+/* Per-position scratch of the optimal parser, grown as needed. */
+typedef struct
+{
+    int32_t	size;
+    uint8_t	*len, *choice;
+    uint16_t	*dist;
+    int32_t	*cost;
+} lz_opt_t;
+
+
+/* Encoder context. Each of the per-algorithm states is only allocated the
+   first time that algorithm is used with the context, so a context that
+   only ever does LZMIT does not carry the LZSS window around. */
+struct comp_ctx_t
+{
+    lzss_state_t *	lzss;
+    lzmit_state_t *	lzmit;
+    lz_hash_t *		hash;
+    lz_bt_t *		bt;
+    lz_opt_t		opt;
+
+    int			engine, parse, lazy;
+    int32_t		chain_limit, depth_limit;
+    int32_t		scan_threshold;
+
+    int32_t		out_size;		/* Set for compress_safe_ctx(). */
+};
+
+
+/* Token writer used by the generic encoders. Flag bits are set for
+   literals, starting from the lowest bit, and a match is written as a
+   little endian word of (distance - 1) << 4 | (length - bias). */
+typedef struct
+{
+    uint8_t *	buf;
+    int32_t	pos, flag_pos;
+    int		flag_bit;
+} lz_out_t;
+
+
+static __inline void
+lz_out_init(lz_out_t *out, uint8_t *buf)
+{
+    out->buf = buf;
+    out->flag_pos = 0;
+    out->flag_bit = 0;
+    out->buf[0] = 0x00;
+    out->pos = 1;
+}
+
+
+static __inline void
+lz_out_next(lz_out_t *out)
+{
+    if (++out->flag_bit == 8) {
+	out->flag_pos = out->pos++;
+	out->buf[out->flag_pos] = 0x00;
+	out->flag_bit = 0;
+    }
+}
+
+
+static __inline void
+lz_out_literal(lz_out_t *out, uint8_t val)
+{
+    out->buf[out->flag_pos] |= (1 << out->flag_bit);
+    out->buf[out->pos++] = val;
+    lz_out_next(out);
+}
+
+
+static __inline void
+lz_out_match(lz_out_t *out, int16_t type, int32_t dist, int32_t len)
+{
+    uint16_t temp = ((dist - 1) << LZ_LENGTH_BIT_COUNT) | (len - LZ_MIN_MATCH(type));
+
+    out->buf[out->pos] = temp & 0xff;
+    out->buf[out->pos + 1] = temp >> 8;
+    out->pos += 2;
+    lz_out_next(out);
+}
+
+
+/* Returns the final length; a trailing flag byte with no tokens after it
+   is dropped, just like the original encoders do. */
+static __inline int32_t
+lz_out_finish(lz_out_t *out)
+{
+    if (out->flag_bit == 0)
+	out->pos--;
+
+    return out->pos;
+}
+
+
+/* The original encoders give up once the output stops being smaller
+   than the input: LZSS reports the input length, LZMIT reports -1, and
+   LZMIT gives up a look ahead buffer early. The generic encoders keep
+   the same behaviour so callers do not have to care which one ran.
+   Every encoder checks the limit before a token, and a token plus the
+   flag byte after it is at most LZ_OUT_SLACK bytes, so an output
+   capacity is honoured by lowering the limit by that much. */
+#define LZ_OUT_SLACK		2
+
+
+static __inline int32_t
+lz_out_limit(comp_ctx_t *ctx, int16_t type, int32_t length)
+{
+    int32_t limit = (type == 1) ? length : (length - (1 << LZ_LENGTH_BIT_COUNT) - 1);
+
+    if ((ctx->out_size > 0) && (limit > (ctx->out_size - LZ_OUT_SLACK)))
+	limit = ctx->out_size - LZ_OUT_SLACK;
+
+    return limit;
+}
+
+
+static __inline int32_t
+lz_out_fail(int16_t type, int32_t length)
+{
+    return (type == 1) ? length : -1;
+}
+
+
+/* Length of the common prefix of a and b, up to max bytes. avail is how
+   many bytes can safely be read from both a and b, which may be more than
+   max; the wide compares are only used while a whole word or vector is
+   readable, so a caller that has slack after its buffers should say so.
+   Most candidates mismatch within the first few bytes, so the first word
+   is always checked with a plain 64-bit compare before going wide. */
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+
+static __inline int32_t
+lz_word_diff(uint64_t x)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return __builtin_clzll(x) >> 3;
+#else
+    return __builtin_ctzll(x) >> 3;
+#endif
+}
+
+
+static __inline int32_t
+lz_match_len(const uint8_t *a, const uint8_t *b, int32_t max, int32_t avail)
+{
+    int32_t i = 0;
+    uint64_t x, y;
+#if defined(__AVX2__) || defined(__SSE2__)
+    uint32_t mask;
+#endif
+
+    if ((max > 0) && (a[0] != b[0]))
+	return 0;
+
+    if ((max > 0) && (avail >= 8)) {
+	memcpy(&x, a, 8);
+	memcpy(&y, b, 8);
+	x ^= y;
+	if (x != 0) {
+		i = lz_word_diff(x);
+		return (i < max) ? i : max;
+	}
+	i = 8;
+    }
+
+#if defined(__AVX2__)
+    while ((i < max) && ((avail - i) >= 32)) {
+	mask = ~((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)),
+								     _mm256_loadu_si256((const __m256i *) (b + i)))));
+	if (mask != 0) {
+		i += __builtin_ctz(mask);
+		return (i < max) ? i : max;
+	}
+	i += 32;
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    while ((i < max) && ((avail - i) >= 16)) {
+	mask = ~((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+							     _mm_loadu_si128((const __m128i *) (b + i))))) & 0xffff;
+	if (mask != 0) {
+		i += __builtin_ctz(mask);
+		return (i < max) ? i : max;
+	}
+	i += 16;
+    }
+#endif
+
+    while ((i < max) && ((avail - i) >= 8)) {
+	memcpy(&x, a + i, 8);
+	memcpy(&y, b + i, 8);
+	x ^= y;
+	if (x != 0) {
+		i += lz_word_diff(x);
+		return (i < max) ? i : max;
+	}
+	i += 8;
+    }
+
+    while ((i < max) && (a[i] == b[i]))
+	i++;
+
+    return (i < max) ? i : max;
+}
+
+
+extern lzss_state_t *	lzss_state_new(void);
+extern void		lzss_state_free(lzss_state_t *s);
+
+extern lzmit_state_t *	lzmit_state_new(void);
+extern void		lzmit_state_free(lzmit_state_t *s);
+
+extern lz_hash_t *	lz_hash_new(void);
+extern void		lz_hash_free(lz_hash_t *h);
+extern void		lz_hash_reset(lz_hash_t *h, const uint8_t *buf, int32_t start, int32_t end);
+extern void		lz_hash_insert(lz_hash_t *h, const uint8_t *buf, int32_t pos);
+extern int32_t		lz_hash_find(lz_hash_t *h, const uint8_t *buf, int32_t pos, int32_t max_len,
+				     int32_t avail, int32_t chain_limit, int32_t *dist);
+
+extern lz_bt_t *	lz_bt_new(void);
+extern void		lz_bt_free(lz_bt_t *bt);
+extern void		lz_bt_reset(lz_bt_t *bt, const uint8_t *buf, int32_t start, int32_t end);
+extern int32_t		lz_bt_find(lz_bt_t *bt, const uint8_t *buf, int32_t pos, int32_t max_len,
+				   int32_t avail, int32_t *dist);
+
+extern void		lz_opt_free(lz_opt_t *opt);
+
+extern int		lz_scan_incompressible(int16_t type, const uint8_t *buf, int32_t length,
+					       int32_t threshold);
+
+extern int32_t		lz_compress_optimal(comp_ctx_t *ctx, int16_t type, uint8_t *output,
+					    const uint8_t *input, int32_t length);
+extern void		lz_hash_rebase(lz_hash_t *h, int32_t shift);
+
+extern int32_t		lz_parse_greedy(lz_hash_t *h, int32_t chain_limit, int lazy, int16_t type, lz_out_t *out,
+					const uint8_t *buf, int32_t pos, int32_t stop, int32_t end, int32_t limit);
+extern int32_t		lz_compress_greedy(comp_ctx_t *ctx, int16_t type, uint8_t *output,
+					   const uint8_t *input, int32_t length);
+
+
+#endif	/*LBATOOLS_LZ_H*/
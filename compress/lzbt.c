@@ -0,0 +1,103 @@
+/* Binary tree match finder for the LZ encoders. Unlike the trees of the
+   original encoders, nodes are never deleted: every insertion makes the
+   new position the root of its tree and splits the old tree along the
+   search path into its smaller and larger halves, cutting off whatever
+   has slid out of the window on the way. Since the search path of a
+   sorted tree passes both neighbours of the new string, the longest
+   match in the window is always found. */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include "lz.h"
+
+
+#define UNUSED			-1
+#define MOD_BT(a)		((a) & (LZ_BT_SIZE - 1))
+
+
+lz_bt_t *
+lz_bt_new(void)
+{
+    lz_bt_t *bt = (lz_bt_t *) malloc(sizeof(lz_bt_t));
+
+    if (bt != NULL)
+	memset(bt->head, UNUSED, sizeof(bt->head));
+
+    return bt;
+}
+
+
+void
+lz_bt_free(lz_bt_t *bt)
+{
+    free(bt);
+}
+
+
+/* Same as lz_hash_reset(): only the heads the buffer hashes to are
+   cleared, the nodes are always written when their position is inserted. */
+void
+lz_bt_reset(lz_bt_t *bt, const uint8_t *buf, int32_t start, int32_t end)
+{
+    int32_t i;
+
+    for (i = start; i < (end - 1); i++)
+	bt->head[LZ_HASH_KEY(buf + i)] = UNUSED;
+}
+
+
+/* Inserts the string at pos, of which at least two and at most max_len
+   bytes are looked at, and returns the length of the longest match for
+   it, with its distance in *dist. avail is the number of bytes readable
+   from pos on. */
+int32_t
+lz_bt_find(lz_bt_t *bt, const uint8_t *buf, int32_t pos, int32_t max_len, int32_t avail, int32_t *dist)
+{
+    int32_t key = LZ_HASH_KEY(buf + pos);
+    int32_t cand = bt->head[key];
+    int32_t *smaller = &bt->left[MOD_BT(pos)];
+    int32_t *larger = &bt->right[MOD_BT(pos)];
+    int32_t len, len_smaller = 0, len_larger = 0, best_len = 0;
+
+    bt->head[key] = pos;
+
+    while ((cand != UNUSED) && ((pos - cand) <= LZ_MAX_DIST)) {
+	/* Both halves of the path agree with the new string on at least
+	   the shorter of their prefixes, so that much needs no compare. */
+	len = (len_smaller < len_larger) ? len_smaller : len_larger;
+	len += lz_match_len(buf + cand + len, buf + pos + len, max_len - len, avail - len);
+
+	if (len > best_len) {
+		best_len = len;
+		*dist = pos - cand;
+	}
+
+	if (len >= max_len) {
+		/* Equal as far as we can tell, the new node takes over. */
+		*smaller = bt->left[MOD_BT(cand)];
+		*larger = bt->right[MOD_BT(cand)];
+		return best_len;
+	}
+
+	if (buf[cand + len] < buf[pos + len]) {
+		*smaller = cand;
+		smaller = &bt->right[MOD_BT(cand)];
+		cand = *smaller;
+		len_smaller = len;
+	} else {
+		*larger = cand;
+		larger = &bt->left[MOD_BT(cand)];
+		cand = *larger;
+		len_larger = len;
+	}
+    }
+
+    *smaller = *larger = UNUSED;
+
+    return best_len;
+}
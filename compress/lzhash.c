@@ -0,0 +1,119 @@
+/* Hash chain match finder for the LZ encoders. This is a faster, but not
+   exhaustive, alternative to the binary trees of the original encoders:
+   every position is linked into a chain of earlier positions that start
+   with the same two bytes, and a search walks at most chain_limit links
+   of that chain. */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include "lz.h"
+
+
+#define UNUSED			-1
+#define MOD_DIST(a)		((a) & (LZ_MAX_DIST - 1))
+
+
+lz_hash_t *
+lz_hash_new(void)
+{
+    lz_hash_t *h = (lz_hash_t *) malloc(sizeof(lz_hash_t));
+
+    if (h != NULL) {
+	memset(h->head, UNUSED, sizeof(h->head));
+	memset(h->prev, UNUSED, sizeof(h->prev));
+    }
+
+    return h;
+}
+
+
+void
+lz_hash_free(lz_hash_t *h)
+{
+    free(h);
+}
+
+
+/* Only the heads that the buffer can actually hash to are cleared, which
+   keeps the cost proportional to the input rather than to the table. The
+   chain links need no clearing at all, since a link is always written
+   before the position it belongs to is reachable from a head. */
+void
+lz_hash_reset(lz_hash_t *h, const uint8_t *buf, int32_t start, int32_t end)
+{
+    int32_t i;
+
+    for (i = start; i < (end - 1); i++)
+	h->head[LZ_HASH_KEY(buf + i)] = UNUSED;
+}
+
+
+void
+lz_hash_insert(lz_hash_t *h, const uint8_t *buf, int32_t pos)
+{
+    int32_t key = LZ_HASH_KEY(buf + pos);
+
+    h->prev[MOD_DIST(pos)] = h->head[key];
+    h->head[key] = pos;
+}
+
+
+/* Moves every position in the finder back by shift bytes, for a caller
+   that slides its buffer. shift must be a multiple of LZ_MAX_DIST so that
+   every link stays in its slot of the ring; positions that would become
+   negative are out of the window anyway and are dropped. */
+void
+lz_hash_rebase(lz_hash_t *h, int32_t shift)
+{
+    int32_t i;
+
+    for (i = 0; i < LZ_HASH_SIZE; i++)
+	h->head[i] = (h->head[i] >= shift) ? (h->head[i] - shift) : UNUSED;
+
+    for (i = 0; i < LZ_MAX_DIST; i++)
+	h->prev[i] = (h->prev[i] >= shift) ? (h->prev[i] - shift) : UNUSED;
+}
+
+
+/* Finds the longest match for the string at pos, of at most max_len bytes,
+   and links pos into its chain. The caller must make sure there are at
+   least two bytes at pos; avail is the number of bytes readable from pos
+   on. Returns the match length, or 0 if there is no candidate within
+   reach. */
+int32_t
+lz_hash_find(lz_hash_t *h, const uint8_t *buf, int32_t pos, int32_t max_len,
+	     int32_t avail, int32_t chain_limit, int32_t *dist)
+{
+    int32_t key = LZ_HASH_KEY(buf + pos);
+    int32_t cand = h->head[key];
+    int32_t len, best_len = 0;
+
+    if (chain_limit <= 0)
+	chain_limit = LZ_MAX_DIST;
+
+    while ((cand != UNUSED) && ((pos - cand) <= LZ_MAX_DIST) && (chain_limit-- > 0)) {
+	/* Cheap reject: a candidate can only beat the best match so far if
+	   it agrees on the byte just past it. */
+	if (buf[cand + best_len] == buf[pos + best_len]) {
+		len = lz_match_len(buf + cand, buf + pos, max_len, avail);
+		if (len > best_len) {
+			best_len = len;
+			*dist = pos - cand;
+			if (len >= max_len)
+				break;
+		}
+	}
+
+	cand = h->prev[MOD_DIST(cand)];
+    }
+
+    h->prev[MOD_DIST(pos)] = h->head[key];
+    h->head[key] = pos;
+
+    return best_len;
+}
@@ -10,6 +10,7 @@
 #include <string.h>
 
 #include <lbatools/compress.h>
+#include "lz.h"
 
 
 #define INDEX_BIT_COUNT		12
@@ -17,6 +18,7 @@
 #define RAW_LOOK_AHEAD_SIZE	(1 << LENGTH_BIT_COUNT)
 #define MAX_OFFSET		((1 << INDEX_BIT_COUNT) + 1)
 #define TREE_ROOT		(MAX_OFFSET)
+#define TREE_CUT		(MAX_OFFSET + 1)
 #define UNUSED			-1
 #define SMALLER			0
 #define LARGER			1
@@ -30,47 +32,85 @@ typedef struct
 } deftree_t;
 
 
-static deftree_t	tree[MAX_OFFSET + 2];
+/* Compact node for the reworked engine. Every index fits in 16 bits, so a
+   node is half the size of a deftree_t and the whole tree fits in 32 KB. */
+typedef struct
+{
+    int16_t	children[2];
+    int16_t	parent;
+    int16_t	which_child;
+} lzmit_node_t;
+
+
+/* dirty is how many nodes, from the start, the last call of the tree
+   engine may have written; only those need clearing for the next one. */
+struct lzmit_state_t
+{
+    deftree_t		tree[MAX_OFFSET + 2];		/* Reference engine. */
+    lzmit_node_t	nodes[MAX_OFFSET + 3];
+    int32_t		dirty;
+};
+
+
+lzmit_state_t *
+lzmit_state_new(void)
+{
+    lzmit_state_t *s = (lzmit_state_t *) malloc(sizeof(lzmit_state_t));
+
+    if (s != NULL) {
+	memset(s, 0x00, sizeof(lzmit_state_t));
+	s->dirty = MAX_OFFSET;
+    }
+
+    return s;
+}
+
+
+void
+lzmit_state_free(lzmit_state_t *s)
+{
+    free(s);
+}
 
 
 static void
-replace_parents(int32_t node)
+replace_parents(lzmit_state_t *s, int32_t node)
 {
-    tree[tree[node + 1].children[SMALLER] + 1].parent = node;
-    tree[tree[node + 1].children[LARGER] + 1].parent = node;
+    s->tree[s->tree[node + 1].children[SMALLER] + 1].parent = node;
+    s->tree[s->tree[node + 1].children[LARGER] + 1].parent = node;
 }
 
 
 static void
-replace_node(int32_t old_node, int32_t new_node)
+replace_node(lzmit_state_t *s, int32_t old_node, int32_t new_node)
 {
-    tree[new_node + 1] = tree[old_node + 1];
+    s->tree[new_node + 1] = s->tree[old_node + 1];
 
-    replace_parents(new_node);
+    replace_parents(s, new_node);
 
-    tree[tree[old_node + 1].parent + 1].children[tree[old_node + 1].which_child] = new_node;
+    s->tree[s->tree[old_node + 1].parent + 1].children[s->tree[old_node + 1].which_child] = new_node;
 }
 
 
 static void
-update_parent(int32_t node, int32_t parent, int32_t which_child)
+update_parent(lzmit_state_t *s, int32_t node, int32_t parent, int32_t which_child)
 {
-    tree[node + 1].parent = parent;
-    tree[node + 1].which_child = which_child;
+    s->tree[node + 1].parent = parent;
+    s->tree[node + 1].which_child = which_child;
 }
 
 
 static int32_t
-find_next_node(int32_t node)
+find_next_node(lzmit_state_t *s, int32_t node)
 {
-    int32_t next = tree[node + 1].children[SMALLER];
+    int32_t next = s->tree[node + 1].children[SMALLER];
 
-    if (tree[next + 1].children[LARGER] == UNUSED)
-	tree[node + 1].children[SMALLER] = tree[next + 1].children[SMALLER];
+    if (s->tree[next + 1].children[LARGER] == UNUSED)
+	s->tree[node + 1].children[SMALLER] = s->tree[next + 1].children[SMALLER];
     else {
-	while (tree[next + 1].children[LARGER] != UNUSED)
-		next = tree[next + 1].children[LARGER];
-	tree[tree[next + 1].parent + 1].children[LARGER] = tree[next + 1].children[SMALLER];
+	while (s->tree[next + 1].children[LARGER] != UNUSED)
+		next = s->tree[next + 1].children[LARGER];
+	s->tree[s->tree[next + 1].parent + 1].children[LARGER] = s->tree[next + 1].children[SMALLER];
     }
 
     return(next);
@@ -78,12 +118,12 @@ find_next_node(int32_t node)
 
 
 static void
-update_child(int32_t src_tree, int32_t which_child)
+update_child(lzmit_state_t *s, int32_t src_tree, int32_t which_child)
 {
-    if (tree[src_tree + 1].children[which_child] != UNUSED)
-	update_parent(tree[src_tree + 1].children[which_child], tree[src_tree + 1].parent, tree[src_tree + 1].which_child);
+    if (s->tree[src_tree + 1].children[which_child] != UNUSED)
+	update_parent(s, s->tree[src_tree + 1].children[which_child], s->tree[src_tree + 1].parent, s->tree[src_tree + 1].which_child);
 
-    tree[tree[src_tree + 1].parent + 1].children[tree[src_tree + 1].which_child] = tree[src_tree + 1].children[which_child];
+    s->tree[s->tree[src_tree + 1].parent + 1].children[s->tree[src_tree + 1].which_child] = s->tree[src_tree + 1].children[which_child];
 }
 
 
@@ -97,13 +137,13 @@ update_child(int32_t src_tree, int32_t which_child)
  * character, then adds the strings that are created by the new
  * character.
  */
-int32_t
-compress_lzmit(char *output, char *input, int32_t length)
+static int32_t
+lzmit_compress_ref(lzmit_state_t *s, int32_t limit, char *output, char *input, int32_t length)
 {
     int32_t val, temp, src_off, out_len, offset_off, flag_bit, best_match = 1, best_node;
     int32_t cur_node, node, i, j, replacement, cmp_string, cur_string, src_tree, diff;
 
-    memset(&(tree[1]), -1, (MAX_OFFSET + 1) * sizeof(deftree_t));
+    memset(&(s->tree[1]), -1, (MAX_OFFSET + 1) * sizeof(deftree_t));
 
     src_off = flag_bit = offset_off = val = 0;
     best_match = out_len = 1;
@@ -113,24 +153,24 @@ compress_lzmit(char *output, char *input, int32_t length)
 	while (i > 0) {
 		src_tree = src_off % MAX_OFFSET;
 
-		if (tree[src_tree + 1].parent != UNUSED) {
-			if ((tree[src_tree + 1].children[SMALLER] != UNUSED) && (tree[src_tree + 1].children[LARGER] != UNUSED)) {
-				replacement = find_next_node(src_tree);
-				update_parent(tree[replacement + 1].children[SMALLER], tree[replacement + 1].parent, tree[replacement + 1].which_child);
-				replace_node(src_tree, replacement);
+		if (s->tree[src_tree + 1].parent != UNUSED) {
+			if ((s->tree[src_tree + 1].children[SMALLER] != UNUSED) && (s->tree[src_tree + 1].children[LARGER] != UNUSED)) {
+				replacement = find_next_node(s, src_tree);
+				update_parent(s, s->tree[replacement + 1].children[SMALLER], s->tree[replacement + 1].parent, s->tree[replacement + 1].which_child);
+				replace_node(s, src_tree, replacement);
 			} else
-				update_child(src_tree, (tree[src_tree + 1].children[SMALLER] == UNUSED) ? LARGER : SMALLER);
+				update_child(s, src_tree, (s->tree[src_tree + 1].children[SMALLER] == UNUSED) ? LARGER : SMALLER);
 		}
 
-		tree[src_tree + 1].children[LARGER] = tree[src_tree + 1].children[SMALLER] = UNUSED;
+		s->tree[src_tree + 1].children[LARGER] = s->tree[src_tree + 1].children[SMALLER] = UNUSED;
 
-		cur_node = tree[TREE_ROOT + 1].children[SMALLER];
+		cur_node = s->tree[TREE_ROOT + 1].children[SMALLER];
 
 		if (cur_node < 0) {
 			best_match = best_node = 0;
 
-			update_parent(src_tree, TREE_ROOT, 0);
-			tree[TREE_ROOT + 1].children[SMALLER] = src_tree;
+			update_parent(s, src_tree, TREE_ROOT, 0);
+			s->tree[TREE_ROOT + 1].children[SMALLER] = src_tree;
 		} else {
 			best_match = 2;
 
@@ -153,16 +193,16 @@ compress_lzmit(char *output, char *input, int32_t length)
 					}
 
 					j = (diff >= 0) ? 1 : 0;
-					cur_node = tree[node + 1].children[j];
+					cur_node = s->tree[node + 1].children[j];
 
 					if (cur_node < 0) {
-						update_parent(src_tree, node, j);
-						tree[node + 1].children[j] = src_tree;
+						update_parent(s, src_tree, node, j);
+						s->tree[node + 1].children[j] = src_tree;
 						break;
 					}
 				} else {
-					replace_node(node, src_tree);
-					tree[node + 1].parent = UNUSED;
+					replace_node(s, node, src_tree);
+					s->tree[node + 1].parent = UNUSED;
 					best_match = (RAW_LOOK_AHEAD_SIZE + 2);
 					best_node = node;
 					break;
@@ -174,7 +214,7 @@ compress_lzmit(char *output, char *input, int32_t length)
 			src_off++;
 	}
 
-	if (out_len >= (length - RAW_LOOK_AHEAD_SIZE  - 1)) {
+	if (out_len >= limit) {
 		out_len = -1;
 		break;
 	}
@@ -210,3 +250,250 @@ compress_lzmit(char *output, char *input, int32_t length)
 
     return out_len;
 }
+
+
+/*
+ * Reworked tree engine. This walks and rebuilds the tree in exactly the same
+ * order as lzmit_compress_ref(), so the output is byte-identical, but:
+ *
+ *   - nodes are the compact lzmit_node_t, addressed through a pointer that
+ *     is already biased by one so UNUSED (-1) indexes the spare slot;
+ *   - the tree slot of the current position is tracked incrementally, so
+ *     there is no % MAX_OFFSET anywhere in the loops;
+ *   - strings are compared with lz_match_len() and only the mismatching
+ *     byte decides which way to go.
+ *
+ * The one difference is that bytes past the end of the input are read as
+ * zeroes instead of whatever follows the buffer in memory, which makes the
+ * output deterministic; it matches the reference on zero padded input.
+ */
+static __inline void
+node_replace(lzmit_node_t *t, int32_t old_node, int32_t new_node)
+{
+    t[new_node] = t[old_node];
+
+    t[t[new_node].children[SMALLER]].parent = new_node;
+    t[t[new_node].children[LARGER]].parent = new_node;
+
+    t[t[old_node].parent].children[t[old_node].which_child] = new_node;
+}
+
+
+static __inline void
+node_set_parent(lzmit_node_t *t, int32_t node, int32_t parent, int32_t which_child)
+{
+    t[node].parent = parent;
+    t[node].which_child = which_child;
+}
+
+
+static __inline int32_t
+node_unlink_next(lzmit_node_t *t, int32_t node)
+{
+    int32_t next = t[node].children[SMALLER];
+
+    if (t[next].children[LARGER] == UNUSED)
+	t[node].children[SMALLER] = t[next].children[SMALLER];
+    else {
+	while (t[next].children[LARGER] != UNUSED)
+		next = t[next].children[LARGER];
+	t[t[next].parent].children[LARGER] = t[next].children[SMALLER];
+    }
+
+    return next;
+}
+
+
+static __inline void
+node_delete(lzmit_node_t *t, int32_t node)
+{
+    int32_t replacement, which_child, child;
+
+    if ((t[node].children[SMALLER] != UNUSED) && (t[node].children[LARGER] != UNUSED)) {
+	replacement = node_unlink_next(t, node);
+	node_set_parent(t, t[replacement].children[SMALLER], t[replacement].parent, t[replacement].which_child);
+	node_replace(t, node, replacement);
+    } else {
+	which_child = (t[node].children[SMALLER] == UNUSED) ? LARGER : SMALLER;
+	child = t[node].children[which_child];
+	if (child != UNUSED)
+		node_set_parent(t, child, t[node].parent, t[node].which_child);
+	t[t[node].parent].children[t[node].which_child] = child;
+    }
+}
+
+
+/* Compares the strings at cur and cmp (cmp < cur) for up to max bytes and
+   returns the number of equal bytes; *diff gets the signed difference of
+   the first unequal pair, compared as char like the reference does. */
+static __inline int32_t
+lzmit_compare(const char *input, int32_t length, int32_t cur, int32_t cmp, int32_t max, int32_t *diff)
+{
+    int32_t len, a, b;
+
+    if ((cur + max) <= length) {
+	len = lz_match_len((const uint8_t *) input + cur, (const uint8_t *) input + cmp, max, length - cur);
+	*diff = (len < max) ? ((int32_t) input[cur + len] - (int32_t) input[cmp + len]) : 0;
+	return len;
+    }
+
+    for (len = 0; len < max; len++) {
+	a = ((cur + len) < length) ? input[cur + len] : 0;
+	b = ((cmp + len) < length) ? input[cmp + len] : 0;
+	if (a != b) {
+		*diff = a - b;
+		return len;
+	}
+    }
+
+    *diff = 0;
+    return len;
+}
+
+
+/* If depth is not 0, the search for each position visits at most that
+   many nodes, and then cuts the subtree it would have gone on into off to
+   TREE_CUT, the same way the LZSS tree does it. */
+static int32_t
+lzmit_compress_tree(lzmit_state_t *s, int32_t depth, int32_t limit, char *output, char *input, int32_t length)
+{
+    lzmit_node_t *t = &(s->nodes[1]);
+    int32_t val, temp, src_off, src_tree, out_len, offset_off, flag_bit;
+    int32_t best_match, best_node = 0, cur_node, node, dist, len, diff, dir, i, visits;
+
+    /* nodes[0] is t[-1], and the root and the cut are the last two. */
+    memset(s->nodes, 0xff, (s->dirty + 1) * sizeof(lzmit_node_t));
+    memset(&t[TREE_ROOT], 0xff, 2 * sizeof(lzmit_node_t));
+    s->dirty = (length < MAX_OFFSET) ? length : MAX_OFFSET;
+
+    src_off = src_tree = flag_bit = offset_off = val = 0;
+    best_match = out_len = 1;
+
+    while ((best_match + src_off - 1) < length) {
+	for (i = best_match; i > 0; ) {
+		if (t[src_tree].parent != UNUSED)
+			node_delete(t, src_tree);
+
+		t[src_tree].children[LARGER] = t[src_tree].children[SMALLER] = UNUSED;
+
+		cur_node = t[TREE_ROOT].children[SMALLER];
+
+		if (cur_node < 0) {
+			best_match = best_node = 0;
+
+			node_set_parent(t, src_tree, TREE_ROOT, 0);
+			t[TREE_ROOT].children[SMALLER] = src_tree;
+		} else {
+			best_match = 2;
+			visits = depth;
+
+			while (1) {
+				node = cur_node;
+				dist = src_tree - node;
+				if (dist < 0)
+					dist += MAX_OFFSET;
+
+				len = lzmit_compare(input, length, src_off, src_off - dist,
+						    RAW_LOOK_AHEAD_SIZE + 2, &diff);
+
+				if (len < (RAW_LOOK_AHEAD_SIZE + 2)) {
+					if (len > best_match) {
+						best_match = len;
+						best_node = node;
+					}
+
+					dir = (diff >= 0) ? LARGER : SMALLER;
+					cur_node = t[node].children[dir];
+
+					if (cur_node < 0) {
+						node_set_parent(t, src_tree, node, dir);
+						t[node].children[dir] = src_tree;
+						break;
+					}
+
+					if (--visits == 0) {
+						node_set_parent(t, cur_node, TREE_CUT, 0);
+						node_set_parent(t, src_tree, node, dir);
+						t[node].children[dir] = src_tree;
+						break;
+					}
+				} else {
+					node_replace(t, node, src_tree);
+					t[node].parent = UNUSED;
+					best_match = (RAW_LOOK_AHEAD_SIZE + 2);
+					best_node = node;
+					break;
+				}
+			}
+		}
+
+		if (--i > 0) {
+			src_off++;
+			if (++src_tree == MAX_OFFSET)
+				src_tree = 0;
+		}
+	}
+
+	if (out_len >= limit) {
+		out_len = -1;
+		break;
+	}
+
+	val >>= 1;
+
+	if ((best_match > 2) && (src_off + best_match <= length)) {
+		dist = src_tree - best_node;
+		if (dist <= 0)
+			dist += MAX_OFFSET;
+		temp = (best_match - 3) | ((dist - 1) << LENGTH_BIT_COUNT);
+		output[out_len] = temp & 0xff;
+		output[out_len + 1] = temp >> 8;
+		out_len += 2;
+	} else {
+		output[out_len++] = input[src_off];
+		val |= 0x80;
+		best_match = 1;
+	}
+
+	flag_bit++;
+	if (flag_bit >= 8) {
+		flag_bit = 0;
+		output[offset_off] = val & 0xff;
+		offset_off = out_len;
+		out_len++;
+	}
+
+	src_off++;
+	if (++src_tree == MAX_OFFSET)
+		src_tree = 0;
+    }
+
+    if (flag_bit == 0)
+	out_len--;
+    else if (flag_bit < 8)
+	output[offset_off] = val >> (8 - flag_bit);
+
+    return out_len;
+}
+
+
+int32_t
+compress_lzmit_ctx(comp_ctx_t *ctx, char *output, char *input, int32_t length)
+{
+    if (ctx->parse == COMP_PARSE_OPTIMAL)
+	return lz_compress_optimal(ctx, 2, (uint8_t *) output, (uint8_t *) input, length);
+
+    if (ctx->engine == COMP_ENGINE_HASH)
+	return lz_compress_greedy(ctx, 2, (uint8_t *) output, (uint8_t *) input, length);
+
+    if (ctx->lzmit == NULL) {
+	ctx->lzmit = lzmit_state_new();
+	if (ctx->lzmit == NULL)
+		return -1;
+    }
+
+    if (ctx->engine == COMP_ENGINE_TREE_REF)
+	return lzmit_compress_ref(ctx->lzmit, lz_out_limit(ctx, 2, length), output, input, length);
+
+    return lzmit_compress_tree(ctx->lzmit, ctx->depth_limit, lz_out_limit(ctx, 2, length), output, input, length);
+}
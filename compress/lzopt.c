@@ -0,0 +1,132 @@
+/* Optimal (minimum size) parser for both LZ types. Every token costs the
+   same no matter what it codes - a literal is 8 bits plus a flag bit, a
+   match is 16 bits plus a flag bit - so the cheapest way to code a
+   position only depends on how long the longest match there is: any
+   shorter length at the same distance is a match as well. The parser
+   finds the longest match at every position with the binary tree match
+   finder, then does a shortest path pass from the end of the input back
+   to the start and emits the cheapest token sequence it found. */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include "lz.h"
+
+
+#define LITERAL_COST		9
+#define MATCH_COST		17
+
+
+static int
+lz_opt_grow(lz_opt_t *opt, int32_t size)
+{
+    if (size <= opt->size)
+	return 1;
+
+    lz_opt_free(opt);
+
+    opt->len = (uint8_t *) malloc(size);
+    opt->choice = (uint8_t *) malloc(size);
+    opt->dist = (uint16_t *) malloc(size * sizeof(uint16_t));
+    opt->cost = (int32_t *) malloc((size + 1) * sizeof(int32_t));
+
+    if ((opt->len == NULL) || (opt->choice == NULL) || (opt->dist == NULL) || (opt->cost == NULL)) {
+	lz_opt_free(opt);
+	return 0;
+    }
+
+    opt->size = size;
+
+    return 1;
+}
+
+
+void
+lz_opt_free(lz_opt_t *opt)
+{
+    free(opt->len);
+    free(opt->choice);
+    free(opt->dist);
+    free(opt->cost);
+
+    memset(opt, 0x00, sizeof(lz_opt_t));
+}
+
+
+int32_t
+lz_compress_optimal(comp_ctx_t *ctx, int16_t type, uint8_t *output, const uint8_t *input, int32_t length)
+{
+    int32_t pos, len, max_len, dist = 0, cost, limit;
+    int32_t min_match = LZ_MIN_MATCH(type);
+    lz_opt_t *opt = &ctx->opt;
+    lz_out_t out;
+
+    if (length == 0)
+	return 0;
+
+    if (ctx->bt == NULL) {
+	ctx->bt = lz_bt_new();
+	if (ctx->bt == NULL)
+		return -1;
+    }
+
+    if (!lz_opt_grow(opt, length))
+	return -1;
+
+    /* Pass 1: the longest match at every position. */
+    lz_bt_reset(ctx->bt, input, 0, length);
+    for (pos = 0; pos < length; pos++) {
+	max_len = length - pos;
+	if (max_len > LZ_MAX_MATCH(type))
+		max_len = LZ_MAX_MATCH(type);
+
+	if (max_len >= 2)
+		len = lz_bt_find(ctx->bt, input, pos, max_len, length - pos, &dist);
+	else
+		len = 0;
+
+	if (len >= min_match) {
+		opt->len[pos] = len;
+		opt->dist[pos] = dist;
+	} else
+		opt->len[pos] = 0;
+    }
+
+    /* Pass 2: cheapest cost from every position to the end. A choice of
+       0 means a literal, anything else is the length of the match. */
+    opt->cost[length] = 0;
+    for (pos = length - 1; pos >= 0; pos--) {
+	opt->cost[pos] = opt->cost[pos + 1] + LITERAL_COST;
+	opt->choice[pos] = 0;
+
+	for (len = opt->len[pos]; len >= min_match; len--) {
+		cost = opt->cost[pos + len] + MATCH_COST;
+		if (cost < opt->cost[pos]) {
+			opt->cost[pos] = cost;
+			opt->choice[pos] = len;
+		}
+	}
+    }
+
+    /* Pass 3: emit the path. */
+    limit = lz_out_limit(ctx, type, length);
+    lz_out_init(&out, output);
+
+    for (pos = 0; pos < length; ) {
+	len = opt->choice[pos];
+	if (len != 0) {
+		lz_out_match(&out, type, opt->dist[pos], len);
+		pos += len;
+	} else
+		lz_out_literal(&out, input[pos++]);
+
+	if (out.pos >= limit)
+		return lz_out_fail(type, length);
+    }
+
+    return lz_out_finish(&out);
+}
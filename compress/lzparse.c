@@ -0,0 +1,106 @@
+/* Generic LZ encoder for both compression types, driven by the match
+   finders in lzhash.c rather than by the binary trees of the original
+   encoders. The output is a valid stream for the selected type, but it
+   is not byte-identical to what compress_lzss()/compress_lzmit() make. */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include "lz.h"
+
+
+/* Greedy parse of the positions from pos up to (not including) stop, with
+   end being the end of the data available; a match may run past stop, but
+   never past end. Returns the position parsing stopped at, which can be
+   beyond stop, or -1 once the output has grown to limit bytes. This is
+   shared by lz_compress_greedy() and the streaming encoder, so both make
+   exactly the same decisions.
+   With lazy set, a match that is not already as long as it can be is only
+   taken if the next position does not have a longer one; otherwise a
+   literal is written and the longer match is considered in its place. */
+int32_t
+lz_parse_greedy(lz_hash_t *h, int32_t chain_limit, int lazy, int16_t type, lz_out_t *out,
+		const uint8_t *buf, int32_t pos, int32_t stop, int32_t end, int32_t limit)
+{
+    int32_t len = 0, max_len, next, next_len, dist = 0, next_dist = 0;
+    int found = 0, linked;
+
+    while (pos < stop) {
+	max_len = end - pos;
+	if (max_len > LZ_MAX_MATCH(type))
+		max_len = LZ_MAX_MATCH(type);
+
+	if (found)
+		found = 0;
+	else if (max_len >= 2)
+		len = lz_hash_find(h, buf, pos, max_len, end - pos, chain_limit, &dist);
+	else
+		len = 0;
+
+	linked = pos + 1;
+
+	if (lazy && (len >= LZ_MIN_MATCH(type)) && (len < max_len) &&
+	    ((pos + 1) < stop) && ((pos + 1) < (end - 1))) {
+		next_len = end - pos - 1;
+		if (next_len > LZ_MAX_MATCH(type))
+			next_len = LZ_MAX_MATCH(type);
+		next_len = lz_hash_find(h, buf, pos + 1, next_len, end - pos - 1, chain_limit, &next_dist);
+		linked++;
+
+		if (next_len > len) {
+			lz_out_literal(out, buf[pos++]);
+			len = next_len;
+			dist = next_dist;
+			found = 1;
+			if (out->pos >= limit)
+				return -1;
+			continue;
+		}
+	}
+
+	if (len >= LZ_MIN_MATCH(type)) {
+		lz_out_match(out, type, dist, len);
+		/* Link the rest of the match into the chains. */
+		next = pos + len;
+		for (pos = linked; pos < next; pos++) {
+			if (pos < (end - 1))
+				lz_hash_insert(h, buf, pos);
+		}
+	} else
+		lz_out_literal(out, buf[pos++]);
+
+	if (out->pos >= limit)
+		return -1;
+    }
+
+    return pos;
+}
+
+
+int32_t
+lz_compress_greedy(comp_ctx_t *ctx, int16_t type, uint8_t *output, const uint8_t *input, int32_t length)
+{
+    lz_out_t out;
+
+    if (length == 0)
+	return 0;
+
+    if (ctx->hash == NULL) {
+	ctx->hash = lz_hash_new();
+	if (ctx->hash == NULL)
+		return -1;
+    }
+
+    lz_hash_reset(ctx->hash, input, 0, length);
+    lz_out_init(&out, output);
+
+    if (lz_parse_greedy(ctx->hash, ctx->chain_limit, ctx->lazy, type, &out, input, 0, length, length,
+			lz_out_limit(ctx, type, length)) < 0)
+	return lz_out_fail(type, length);
+
+    return lz_out_finish(&out);
+}
@@ -0,0 +1,141 @@
+/* Incompressibility pre-scan for the LZ encoders. The original encoders
+   only find out that data does not compress once they have done nearly
+   all of the work on it, which for already compressed audio is several
+   seconds per archive. This looks at a few samples of the input instead:
+   the order-0 entropy of the sampled bytes first, and if that is high, a
+   quick parse of the samples with a one-entry hash table to see how much
+   the matches could save. It is only an estimate, and it can miss matches
+   the encoders find, so it is off unless comp_ctx_set_scan() turns it
+   on. */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include "lz.h"
+
+
+#define SCAN_MIN_LENGTH		4096		/* Smaller inputs are not worth it. */
+#define SCAN_BLOCK_SIZE		1024
+#define SCAN_BLOCKS		16
+#define SCAN_HASH_BITS		12
+#define SCAN_HASH_SIZE		(1 << SCAN_HASH_BITS)
+#define SCAN_HASH(p)		((((p)[0] << 8) ^ ((p)[1] << 4) ^ (p)[2]) & (SCAN_HASH_SIZE - 1))
+
+/* Below this many bits per byte, there are enough repeated symbols for
+   the full encoder to be worth running, whatever the probes say. */
+#define SCAN_MIN_ENTROPY	(7 << 16)
+
+
+/* log2(x) in 16.16 fixed point, for x >= 1: the integer part from the
+   highest set bit, and the fraction f from a quadratic fit of log2(1 + f),
+   which is within 0.01 of the real thing. */
+static uint32_t
+lz_log2(uint32_t x)
+{
+    uint32_t n = 31 - __builtin_clz(x);
+    uint32_t f = (n >= 16) ? ((x >> (n - 16)) & 0xffff) : ((x << (16 - n)) & 0xffff);
+
+    return (n << 16) + f + ((f * (0x10000 - f)) >> 16) * 22713 / 65536;
+}
+
+
+/* Sampled order-0 entropy in bits per byte, in 16.16 fixed point. */
+static uint32_t
+lz_scan_entropy(const uint8_t *buf, int32_t length, int32_t step)
+{
+    uint32_t counts[256], total = 0;
+    uint64_t sum = 0;
+    int32_t i, j;
+
+    memset(counts, 0x00, sizeof(counts));
+
+    for (i = 0; (i + SCAN_BLOCK_SIZE) <= length; i += step) {
+	for (j = 0; j < SCAN_BLOCK_SIZE; j++)
+		counts[buf[i + j]]++;
+	total += SCAN_BLOCK_SIZE;
+    }
+
+    for (i = 0; i < 256; i++) {
+	if (counts[i] != 0)
+		sum += (uint64_t) counts[i] * lz_log2(counts[i]);
+    }
+
+    return lz_log2(total) - (uint32_t) (sum / total);
+}
+
+
+/* Size the samples would have if every match the probes find were coded,
+   in per mille of their length: 9 bits for a literal, 17 for a match.
+   The window of LZ_MAX_DIST bytes before each sample is hashed first, so
+   that matches reaching back out of the sample count too. Positions inside
+   a match are not probed and a one-entry table loses candidates, so the
+   data can look less compressible than it is, never more. */
+static int32_t
+lz_scan_probe(int16_t type, const uint8_t *buf, int32_t length, int32_t step)
+{
+    int32_t table[SCAN_HASH_SIZE];
+    int32_t i, pos, end, cand, len, max_len;
+    int64_t bits = 0, total = 0;
+
+    for (i = 0; i < SCAN_HASH_SIZE; i++)
+	table[i] = -1;
+
+    for (i = 0; (i + SCAN_BLOCK_SIZE) <= length; i += step) {
+	end = i + SCAN_BLOCK_SIZE;
+
+	for (pos = (i > LZ_MAX_DIST) ? (i - LZ_MAX_DIST) : 0; pos < i; pos++)
+		table[SCAN_HASH(buf + pos)] = pos;
+
+	while (pos < (end - 2)) {
+		max_len = end - pos;
+		if (max_len > LZ_MAX_MATCH(type))
+			max_len = LZ_MAX_MATCH(type);
+
+		cand = table[SCAN_HASH(buf + pos)];
+		table[SCAN_HASH(buf + pos)] = pos;
+
+		len = 0;
+		if ((cand >= 0) && ((pos - cand) <= LZ_MAX_DIST))
+			len = lz_match_len(buf + cand, buf + pos, max_len, end - pos);
+
+		if (len >= LZ_MIN_MATCH(type)) {
+			bits += 17;
+			pos += len;
+		} else {
+			bits += 9;
+			pos++;
+		}
+	}
+
+	bits += (end - pos) * 9;
+	total += SCAN_BLOCK_SIZE;
+    }
+
+    return (int32_t) ((bits * 1000) / (total * 8));
+}
+
+
+/* Returns 1 if the input looks like it will not compress with the given
+   type at the given threshold (see comp_ctx_set_scan()), 0 otherwise. */
+int
+lz_scan_incompressible(int16_t type, const uint8_t *buf, int32_t length, int32_t threshold)
+{
+    int32_t step;
+
+    if ((threshold <= 0) || (length < SCAN_MIN_LENGTH))
+	return 0;
+
+    /* Up to SCAN_BLOCKS blocks, spread evenly over the input. */
+    step = (length - SCAN_BLOCK_SIZE) / (SCAN_BLOCKS - 1);
+    if (step < SCAN_BLOCK_SIZE)
+	step = SCAN_BLOCK_SIZE;
+
+    if (lz_scan_entropy(buf, length, step) < SCAN_MIN_ENTROPY)
+	return 0;
+
+    return lz_scan_probe(type, buf, length, step) >= threshold;
+}
@@ -13,6 +13,7 @@
 #include <string.h>
 
 #include <lbatools/compress.h>
+#include "lz.h"
 
 
 /************************** Start of LZSS.C ************************
@@ -42,16 +43,24 @@
 #define BREAK_EVEN		(( 1 + INDEX_BIT_COUNT + LENGTH_BIT_COUNT) / 9)
 #define LOOK_AHEAD_SIZE		(RAW_LOOK_AHEAD_SIZE + BREAK_EVEN)
 #define TREE_ROOT		WINDOW_SIZE
+#define TREE_CUT		(WINDOW_SIZE + 1)
 #define UNUSED			-1
 #define MOD_WINDOW(a)		(( a) & (WINDOW_SIZE - 1))
+#define MIRROR_SIZE		LOOK_AHEAD_SIZE
 
 
 /*
- * These are the two global data structures used in this program.
- * The window[] array is exactly that, the window of previously seen
+ * These are the two data structures used in this program.  The
+ * window[] array is exactly that, the window of previously seen
  * text, as well as the current look ahead text.  The tree[] structure
  * contains the binary tree of all of the strings in the window sorted
-* in order.
+ * in order.  Both live in a per-context state rather than in file-scope
+ * statics, so that several contexts can compress at the same time.
+ * The first MIRROR_SIZE bytes of the window are mirrored right after its
+ * end, so a string that wraps around can be compared in one straight
+ * run, and the rest of the array is slack for the wide compares.
+ * dirty is how many window slots and tree nodes, from the start, the
+ * last call may have written; only those need clearing for the next one.
 */
 struct deftree {
     int32_t parent;
@@ -59,28 +68,65 @@ struct deftree {
     int32_t larger_child;
 };
 
-static unsigned char	window[WINDOW_SIZE * 5];
-static struct deftree	tree[WINDOW_SIZE + 2];
+struct lzss_state_t {
+    unsigned char	window[WINDOW_SIZE * 5];
+    struct deftree	tree[WINDOW_SIZE + 2];
+
+    int32_t		match_pos;
+    int32_t		dirty;
+};
 
-static int32_t		match_pos = 0;
+
+lzss_state_t *
+lzss_state_new(void)
+{
+    lzss_state_t *s = (lzss_state_t *) malloc(sizeof(lzss_state_t));
+
+    if (s != NULL) {
+	memset(s, 0x00, sizeof(lzss_state_t));
+	s->dirty = WINDOW_SIZE;
+    }
+
+    return s;
+}
+
+
+void
+lzss_state_free(lzss_state_t *s)
+{
+    free(s);
+}
+
+
+static __inline void
+window_put(lzss_state_t *s, int32_t pos, unsigned char val)
+{
+    s->window[pos] = val;
+    if (pos < MIRROR_SIZE)
+	s->window[WINDOW_SIZE + pos] = val;
+}
 
 
 /*
  * However, to make the tree really usable, a single phrase has to be
  * added to the tree so it has a root node.  That is done right here.
+ * Only the first dirty nodes can have been used since the tree was last
+ * cleared, so the others are left alone.
 */
 static void
-init_tree(int32_t r)
+init_tree(lzss_state_t *s, int32_t r, int32_t dirty)
 {
     int32_t i;
 
-    for (i = 0; i <= WINDOW_SIZE; i++) {
-	tree[i].parent = UNUSED;
-	tree[i].larger_child = UNUSED;
-	tree[i].smaller_child = UNUSED;
+    for (i = 0; i < dirty; i++) {
+	s->tree[i].parent = UNUSED;
+	s->tree[i].larger_child = UNUSED;
+	s->tree[i].smaller_child = UNUSED;
     }
-    tree[TREE_ROOT].larger_child = r;
-    tree[r].parent = TREE_ROOT;
+    s->tree[TREE_ROOT].parent = UNUSED;
+    s->tree[TREE_ROOT].smaller_child = UNUSED;
+    s->tree[TREE_ROOT].larger_child = r;
+    s->tree[r].parent = TREE_ROOT;
 }
 
 
@@ -90,14 +136,15 @@ init_tree(int32_t r)
  * the existing link.
  */
 static void
-contract_node(int32_t old_node, int32_t new_node)
+contract_node(lzss_state_t *s, int32_t old_node, int32_t new_node)
 {
-    tree[new_node].parent = tree[old_node].parent;
-    if (tree[tree[old_node].parent].larger_child == old_node)
-	tree[tree[old_node].parent].larger_child = new_node;
+    if (new_node != UNUSED)
+	s->tree[new_node].parent = s->tree[old_node].parent;
+    if (s->tree[s->tree[old_node].parent].larger_child == old_node)
+	s->tree[s->tree[old_node].parent].larger_child = new_node;
     else
-	tree[tree[old_node].parent].smaller_child = new_node;
-    tree[old_node].parent = UNUSED;
+	s->tree[s->tree[old_node].parent].smaller_child = new_node;
+    s->tree[old_node].parent = UNUSED;
 }
 
 
@@ -107,21 +154,21 @@ contract_node(int32_t old_node, int32_t new_node)
  * in the tree.
  */
 static void
-replace_node(int32_t old_node, int32_t new_node)
+replace_node(lzss_state_t *s, int32_t old_node, int32_t new_node)
 {
     int32_t parent;
 
-    parent = tree[old_node].parent;
-    if (tree[parent].smaller_child == old_node)
-	tree[parent].smaller_child = new_node;
+    parent = s->tree[old_node].parent;
+    if (s->tree[parent].smaller_child == old_node)
+	s->tree[parent].smaller_child = new_node;
     else
-	tree[parent].larger_child = new_node;
-    tree[new_node] = tree[old_node];
-    if (tree[new_node].smaller_child != UNUSED)
-	tree[tree[new_node].smaller_child].parent = new_node;
-    if (tree[new_node].larger_child != UNUSED)
-	tree[tree[new_node].larger_child].parent = new_node;
-    tree[old_node].parent = UNUSED;
+	s->tree[parent].larger_child = new_node;
+    s->tree[new_node] = s->tree[old_node];
+    if (s->tree[new_node].smaller_child != UNUSED)
+	s->tree[s->tree[new_node].smaller_child].parent = new_node;
+    if (s->tree[new_node].larger_child != UNUSED)
+	s->tree[s->tree[new_node].larger_child].parent = new_node;
+    s->tree[old_node].parent = UNUSED;
 }
 
 
@@ -132,13 +179,13 @@ replace_node(int32_t old_node, int32_t new_node)
  * going to the end of the larger_child descendant chain.
 */
 static int
-find_next_node(int32_t node)
+find_next_node(lzss_state_t *s, int32_t node)
 {
     int32_t next;
 
-    next = tree[node].smaller_child;
-    while (tree[next].larger_child != UNUSED)
-	next = tree[next].larger_child;
+    next = s->tree[node].smaller_child;
+    while (s->tree[next].larger_child != UNUSED)
+	next = s->tree[next].larger_child;
     return(next);
 }
 
@@ -152,20 +199,20 @@ find_next_node(int32_t node)
  * with the next link.
  */
 static void
-delete_string(int32_t p)
+delete_string(lzss_state_t *s, int32_t p)
 {
     int32_t replacement;
 
-    if (tree[p].parent == UNUSED)
+    if (s->tree[p].parent == UNUSED)
 	return;
-    if (tree[p].larger_child == UNUSED)
-	contract_node(p, tree[p].smaller_child);
-    else if (tree[p].smaller_child == UNUSED)
-	contract_node(p, tree[p].larger_child);
+    if (s->tree[p].larger_child == UNUSED)
+	contract_node(s, p, s->tree[p].smaller_child);
+    else if (s->tree[p].smaller_child == UNUSED)
+	contract_node(s, p, s->tree[p].larger_child);
     else {
-	replacement = find_next_node(p);
-	delete_string(replacement);
-	replace_node(p, replacement);
+	replacement = find_next_node(s, p);
+	delete_string(s, replacement);
+	replace_node(s, p, replacement);
     }
 }
 
@@ -177,41 +224,54 @@ delete_string(int32_t p)
  * the tree, and return that to the calling routine.  To make matters
  * even more complicated, if the new_node has a duplicate in the tree,
  * the old_node is deleted, for reasons of efficiency.
+ * If depth is not 0, at most that many nodes are visited. The new node
+ * then takes the place of the whole subtree it would have gone into, and
+ * that subtree is hung off TREE_CUT, a node that is never searched, so its
+ * strings are out of reach but can still be deleted the normal way.
  */
 static int32_t
-add_string(int32_t new_node)
+add_string(lzss_state_t *s, int32_t new_node, int32_t depth)
 {
     int32_t i, test_node, delta, match_length;
     int32_t *child;
 
-    test_node = tree[TREE_ROOT].larger_child;
+    test_node = s->tree[TREE_ROOT].larger_child;
     match_length = 0;
     for ( ; ; ) {
-	for ( i = 0 ; i < LOOK_AHEAD_SIZE ; i++ ) {
-		delta = window[MOD_WINDOW(new_node + i)] - window[MOD_WINDOW(test_node + i)];
-		if (delta != 0)
-			break;
-	}
+	i = lz_match_len(s->window + new_node, s->window + test_node, LOOK_AHEAD_SIZE,
+			 sizeof(s->window) - WINDOW_SIZE);
+	if (i < LOOK_AHEAD_SIZE)
+		delta = s->window[new_node + i] - s->window[test_node + i];
+	else
+		delta = 0;
 
 	if (i >= match_length) {
 		match_length = i;
-		match_pos = test_node;
+		s->match_pos = test_node;
 
 		if (match_length >= LOOK_AHEAD_SIZE) {
-			replace_node(test_node, new_node);
+			replace_node(s, test_node, new_node);
 			return(match_length);
 		}
 	}
 
 	if (delta >= 0)
-		child = &tree[test_node].larger_child;
+		child = &s->tree[test_node].larger_child;
 	else
-		child = &tree[test_node].smaller_child;
+		child = &s->tree[test_node].smaller_child;
 	if (*child == UNUSED) {
 		*child = new_node;
-		tree[new_node].parent = test_node;
-		tree[new_node].larger_child = UNUSED;
-		tree[new_node].smaller_child = UNUSED;
+		s->tree[new_node].parent = test_node;
+		s->tree[new_node].larger_child = UNUSED;
+		s->tree[new_node].smaller_child = UNUSED;
+		return(match_length);
+	}
+	if (--depth == 0) {
+		s->tree[*child].parent = TREE_CUT;
+		*child = new_node;
+		s->tree[new_node].parent = test_node;
+		s->tree[new_node].larger_child = UNUSED;
+		s->tree[new_node].smaller_child = UNUSED;
 		return(match_length);
 	}
 	test_node = *child;
@@ -229,8 +289,8 @@ add_string(int32_t new_node)
  * character, then adds the strings that are created by the new
  * character.
  */
-int32_t
-compress_lzss(char *output, char *input, int32_t length)
+static int32_t
+lzss_compress(lzss_state_t *s, int32_t depth, int32_t limit, char *output, char *input, int32_t length)
 {
     int32_t i, j = 0, k = 0;
     int32_t info = 0, look_ahead_bytes;
@@ -239,19 +299,27 @@ compress_lzss(char *output, char *input, int32_t length)
     int32_t new_node = 0;
     int16_t temp;
     char mask = 1;
-    int32_t len = 0, save_length = length;
+    int32_t len = 0, save_length = limit;
+    int32_t dirty = s->dirty;
 
-    match_pos = 0;
+    s->match_pos = 0;
+
+    /* Start from a clean window so that the output does not depend on what
+       was compressed with this state before. This call writes no further
+       than its length into the window and the tree. */
+    memset(s->window, 0x00, dirty);
+    memset(s->window + WINDOW_SIZE, 0x00, (dirty < MIRROR_SIZE) ? dirty : MIRROR_SIZE);
+    s->dirty = (length < WINDOW_SIZE) ? length : WINDOW_SIZE;
 
     for (i = 0; i < LOOK_AHEAD_SIZE; i++) {
 	if (length == 0)
 		break;
-	window[new_node + i] = input[j++];
+	window_put(s, new_node + i, input[j++]);
 	length--;
     }
 
     look_ahead_bytes = i;
-    init_tree(new_node);
+    init_tree(s, new_node, dirty);
     info = k++;
 
     if (++len >= save_length)
@@ -266,14 +334,14 @@ compress_lzss(char *output, char *input, int32_t length)
 	if (match_length <= BREAK_EVEN) {
 		replace_count = 1;
 		output[info] |= mask;
-		output[k++] = window[new_node];
+		output[k++] = s->window[new_node];
 		if (++len >= save_length)
 		return( save_length );
 	} else {
 		if ((len = len + 2) >= save_length)
 			return(save_length);
 
-		temp = (short) ((MOD_WINDOW(new_node - match_pos - 1) << LENGTH_BIT_COUNT) |
+		temp = (short) ((MOD_WINDOW(new_node - s->match_pos - 1) << LENGTH_BIT_COUNT) |
 			       (match_length - BREAK_EVEN - 1));
 		output[k] = temp & 0xff;
 		output[k + 1] = temp >> 8;
@@ -294,17 +362,17 @@ compress_lzss(char *output, char *input, int32_t length)
 		mask = (char) (mask << 1);
 
 	for (i = 0; i < replace_count; i++) {
-		delete_string(MOD_WINDOW(new_node + LOOK_AHEAD_SIZE));
+		delete_string(s, MOD_WINDOW(new_node + LOOK_AHEAD_SIZE));
 		if (length == 0)
 			look_ahead_bytes--;
 		else {
-			window[MOD_WINDOW(new_node + LOOK_AHEAD_SIZE)] = input[j++];
+			window_put(s, MOD_WINDOW(new_node + LOOK_AHEAD_SIZE), input[j++]);
 			length--;
 		}
 
 		new_node = MOD_WINDOW(new_node + 1);
 		if (look_ahead_bytes)
-			match_length = add_string(new_node);
+			match_length = add_string(s, new_node, depth);
 	}
     }
 
@@ -313,4 +381,23 @@ compress_lzss(char *output, char *input, int32_t length)
 
     return len;
 }
+
+
+int32_t
+compress_lzss_ctx(comp_ctx_t *ctx, char *output, char *input, int32_t length)
+{
+    if (ctx->parse == COMP_PARSE_OPTIMAL)
+	return lz_compress_optimal(ctx, 1, (uint8_t *) output, (uint8_t *) input, length);
+
+    if (ctx->engine == COMP_ENGINE_HASH)
+	return lz_compress_greedy(ctx, 1, (uint8_t *) output, (uint8_t *) input, length);
+
+    if (ctx->lzss == NULL) {
+	ctx->lzss = lzss_state_new();
+	if (ctx->lzss == NULL)
+		return -1;
+    }
+
+    return lzss_compress(ctx->lzss, ctx->depth_limit, lz_out_limit(ctx, 1, length), output, input, length);
+}
 /************************** End of LZSS.C *************************/
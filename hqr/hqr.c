@@ -4,6 +4,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
 
 #include <lbatools/compress.h>
 #include <lbatools/hqr.h>
@@ -20,59 +29,147 @@
 #define COMPRESS_LZSS	1
 #define COMPRESS_LZMIT	2
 
+/* Compression type in the header of the free space hqr_update() leaves
+   behind an entry, which the loader skips up to the next entry. */
+#define HQR_FREE	-1
+
 #define UNUSED		-1
 
-#define NUM_ENTRIES	65536
-#define NUM_CHILDREN	65536
-#define NUM_OFFSETS	65536
+/* The arena starts with a block of HQR_BLOCK_SIZE bytes, and every new
+   block is twice as big as the last, up to HQR_BLOCK_MAX. */
+#define HQR_BLOCK_SIZE	65536
+#define HQR_BLOCK_MAX	(64 << 20)
+
+/* The cache of decompressed entries is split in this many shards, each
+   with its own lock, hash table and LRU list, and an equal part of the
+   budget. */
+#define HQR_CACHE_SHARDS	16
+#define HQR_CACHE_BUCKETS	64	/* Initial hash table size of a shard. */
+
+/* HQR_COMPRESS_AUTO: entries at least this big have their LZ candidates
+   made in parallel. The decode time of a candidate is modelled as a fixed
+   time per literal and per match, in seconds, as measured on the packing
+   CPU; LZSS and LZMIT share the decoder, so the times are the same. */
+#define AUTO_THREAD_MIN		16384
+#define AUTO_LITERAL_TIME	2.0e-9
+#define AUTO_MATCH_TIME		3.0e-9
+
+/* Threshold of the incompressibility pre-scan new entries are compressed
+   with. The default only gives up on data that looks close to random,
+   such as already compressed audio, which is then stored without running
+   the LZ encoders over all of it. */
+#define HQR_SCAN_THRESHOLD	COMP_SCAN_DEFAULT
+
+/* Read sizes of the loader, with and without the data. Without it, the
+   next header is often far away, so reading far ahead is a waste. */
+#define HQR_READ_SIZE		262144
+#define HQR_WRITE_SIZE		262144
+#define HQR_INDEX_READ_SIZE	4096
 
 
-static hqr_entry_t	*hqr_entries;
-static hqr_offset_t	*hqr_offsets = NULL;
-static int32_t		hqr_entries_no, hqr_offsets_no;
-// static int32_t		next_entry, next_offset;
-static FILE *		hqr_file = NULL;
 static char *		comp_types[3] = { "None", "LZSS", "LZMIT" };
-static char *		entry_types[8] = { "Null", "Normal", "Pointer", "EOF" };
+static hqr_profile_t	hqr_profiles[3] = { {  200.0, 1.0 },	/* HQR_PROFILE_BALANCED */
+					    {   20.0, 1.0 },	/* HQR_PROFILE_SLOW_DISK */
+					    { 3000.0, 4.0 } };	/* HQR_PROFILE_FAST_DISK_SLOW_CPU */
 
 
-static void
-hqr_child_init(hqr_common_t *hc)
+/* Work queue of hqr_decompress_all(): every entry and child with data,
+   biggest first, handed out one at a time. */
+typedef struct
 {
-    hc->entry_type = ENTRY_NULL;
-    hc->comp_type = COMPRESS_STORE;
-    hc->dec_size = hc->comp_size = 0;
-    hc->desc = hc->data = NULL;
-    hc->tbl_next_off = hc->size_next_off = 0x00000000;
-    hc->offset = 0x00000000;
-}
+    hqr_common_t **	jobs;
+    int32_t		jobs_no, next, failed;
+    pthread_mutex_t	mutex;
+} hqr_pool_t;
 
 
-static void
-hqr_child_add(hqr_t *hqr, int32_t i, hqr_common_t hc)
+/* A block of the arena of a hqr_t, followed by its bytes. The loader puts
+   the data and the children arrays of the entries in the arena, so that
+   they are freed with the blocks rather than one by one. */
+typedef struct hqr_block_s
 {
-    if (hqr->entries_no >= NUM_CHILDREN) {
-	printf("ASSERT: Children exhausted for entry %i\n", i);
-	return;
-    }
+    struct hqr_block_s *	next;
+    int32_t			used, size;
+} hqr_block_t;
 
-    if (hqr->entries[i].children_no == 0)
-	hqr->entries[i].children = (hqr_common_t *) malloc((hqr->entries[i].children_no + 1) * sizeof(hqr_common_t));
-    else
-	hqr->entries[i].children = (hqr_common_t *) realloc(hqr->entries[i].children,
-							    (hqr->entries[i].children_no + 1) * sizeof(hqr_common_t));
 
-    hqr->entries[i].children[hqr->entries[i].children_no] = hc;
-    hqr->entries[i].children_no++;
-}
+/* A decompressed entry or child in the cache, followed by its bytes. */
+typedef struct hqr_cached_s
+{
+    struct hqr_cached_s *	prev, *next;		/* LRU list, most recent first. */
+    struct hqr_cached_s *	chain;			/* Hash chain. */
+    int64_t			key;
+    int32_t			size, refs;
+    int16_t			shard, cached;		/* Not cached once flushed. */
+} hqr_cached_t;
 
 
-static int32_t
-hqr_next_child(hqr_t *hqr, int32_t i, hqr_common_t hc)
+typedef struct
+{
+    pthread_mutex_t	mutex;
+    hqr_cached_t **	table;
+    int32_t		table_size, count;
+    hqr_cached_t *	head, *tail;
+    int64_t		bytes, budget, hits, misses;
+} hqr_shard_t;
+
+
+typedef struct hqr_cache_s
+{
+    hqr_shard_t		shards[HQR_CACHE_SHARDS];
+    pthread_mutex_t	file_mutex;			/* For index-only loads. */
+} hqr_cache_t;
+
+
+/* An entry in the duplicate search of hqr_save(). */
+typedef struct
+{
+    uint64_t		hash;
+    int32_t		entry;
+} hqr_dup_t;
+
+
+/* Write buffer of hqr_save(). */
+typedef struct
+{
+    FILE *		file;
+    uint8_t *		buf;
+    int32_t		len, failed;
+} hqr_writer_t;
+
+
+/* Read buffer of the loader: the bytes at [pos, pos + len) of the file,
+   read ahead bytes at a time. */
+typedef struct
+{
+    hqr_t *		hqr;
+    uint8_t *		buf;
+    int32_t		pos, len, size, ahead, file_len;
+    hqr_common_t *	children;			/* Chain being read. */
+    int32_t		children_size;
+} hqr_reader_t;
+
+
+/* An LZ candidate for HQR_COMPRESS_AUTO. */
+typedef struct
 {
-    hqr_child_add(hqr, i, hc);
+    int16_t		comp_type;
+    int32_t		dec_size, comp_size;
+    char *		buf;
+    uint8_t *		data;
+    int32_t		literals, matches;
+} hqr_candidate_t;
 
-    return (hqr->entries[i].children_no - 1);
+
+static void
+hqr_child_init(hqr_common_t *hc)
+{
+    hc->entry_type = ENTRY_NULL;
+    hc->comp_type = COMPRESS_STORE;
+    hc->dec_size = hc->comp_size = 0;
+    hc->desc = hc->data = hc->dec = NULL;
+    hc->tbl_next_off = hc->size_next_off = 0x00000000;
+    hc->offset = 0x00000000;
 }
 
 
@@ -83,7 +180,7 @@ hqr_entry_init(hqr_entry_t *he)
     he->comp_type = COMPRESS_STORE;
     he->dec_size = he->comp_size = 0;
     he->parent = UNUSED;
-    he->desc = he->data = NULL;
+    he->desc = he->data = he->dec = NULL;
     he->tbl_next_off = he->size_next_off = 0x00000000;
     he->offset = 0x00000000;
 
@@ -92,28 +189,49 @@ hqr_entry_init(hqr_entry_t *he)
 }
 
 
-static void
-hqr_entry_add(hqr_t *hqr, hqr_entry_t he)
+/* Makes room for need elements in an array of *size elements, doubling
+   its size as many times as needed. */
+static int32_t
+hqr_grow(void **array, int32_t *size, int32_t need, size_t elem)
 {
-    if (hqr->entries_no >= NUM_ENTRIES) {
-	printf("ASSERT: Entries exhausted\n");
-	return;
-    }
+    int32_t n = (*size == 0) ? 64 : *size;
+    void *p;
 
-    if (hqr->entries_no == 0)
-	hqr->entries = (hqr_entry_t *) malloc((hqr->entries_no + 1) * sizeof(hqr_entry_t));
-    else
-	hqr->entries = (hqr_entry_t *) realloc(hqr->entries, (hqr->entries_no + 1) * sizeof(hqr_entry_t));
+    if (need <= *size)
+	return 1;
+
+    while (n < need)
+	n <<= 1;
+
+    p = realloc(*array, n * elem);
+    if (p == NULL)
+	return 0;
+
+    *array = p;
+    *size = n;
+
+    return 1;
+}
+
+
+static int32_t
+hqr_entry_add(hqr_t *hqr, hqr_entry_t he)
+{
+    if (!hqr_grow((void **) &hqr->entries, &hqr->entries_size, hqr->entries_no + 1, sizeof(hqr_entry_t)))
+	return 0;
 
     hqr->entries[hqr->entries_no] = he;
     hqr->entries_no++;
+
+    return 1;
 }
 
 
 static int32_t
 hqr_next_entry(hqr_t *hqr, hqr_entry_t he)
 {
-    hqr_entry_add(hqr, he);
+    if (!hqr_entry_add(hqr, he))
+	return UNUSED;
 
     return (hqr->entries_no - 1);
 }
@@ -127,59 +245,115 @@ hqr_offset_init(hqr_offset_t *ho)
 }
 
 
-static void
-hqr_offset_add(hqr_offset_t ho)
+static int32_t
+hqr_offset_add(hqr_t *hqr, hqr_offset_t ho)
 {
-    if (hqr_offsets_no >= NUM_OFFSETS) {
-	printf("ASSERT: Offsets exhausted\n");
-	return;
-    }
+    if (!hqr_grow((void **) &hqr->offsets, &hqr->offsets_size, hqr->offsets_no + 1, sizeof(hqr_offset_t)))
+	return 0;
 
-    if (hqr_offsets_no == 0)
-	hqr_offsets = (hqr_offset_t *) malloc((hqr_offsets_no + 1) * sizeof(hqr_offset_t));
-    else
-	hqr_offsets = (hqr_offset_t *) realloc(hqr_offsets, (hqr_offsets_no + 1) * sizeof(hqr_offset_t));
+    hqr->offsets[hqr->offsets_no] = ho;
+    hqr->offsets_no++;
 
-    hqr_offsets[hqr_offsets_no] = ho;
-    hqr_offsets_no++;
+    return 1;
 }
 
 
 static int32_t
-hqr_next_offset(hqr_offset_t ho)
+hqr_next_offset(hqr_t *hqr, hqr_offset_t ho)
 {
-    hqr_offset_add(ho);
+    if (!hqr_offset_add(hqr, ho))
+	return UNUSED;
 
-    return (hqr_offsets_no - 1);
+    return (hqr->offsets_no - 1);
 }
 
 
+/* Binary search of the offset index, which is sorted once the table has
+   been read. Returns the position of the offset in it, or UNUSED. */
 static int32_t
-hqr_find_same_offset(int32_t offset)
+hqr_find_same_offset(hqr_t *hqr, int32_t offset)
 {
-    int32_t i, ret = UNUSED;
+    int32_t lo = 0, hi = hqr->offsets_no - 1, mid;
+
+    while (lo <= hi) {
+	mid = lo + ((hi - lo) >> 1);
+	if (hqr->offsets[mid].offset == offset)
+		return mid;
+	else if (hqr->offsets[mid].offset < offset)
+		lo = mid + 1;
+	else
+		hi = mid - 1;
+    }
 
-    for (i = 0; i < hqr_offsets_no; i++) {
-	if (hqr_offsets[i].offset == offset) {
-		ret = i;
-		break;
-	}
+    return UNUSED;
+}
+
+
+/* Position of the offset of an entry in the index, or UNUSED. Only needed
+   when entries are edited, which is linear anyway. */
+static int32_t
+hqr_find_entry_offset(hqr_t *hqr, int32_t entry)
+{
+    int32_t i;
+
+    for (i = 0; i < hqr->offsets_no; i++) {
+	if (hqr->offsets[i].entry == entry)
+		return i;
     }
 
-    return ret;
+    return UNUSED;
 }
 
 
-void
-hqr_offsets_clear(void)
+static void
+hqr_offsets_remove(hqr_t *hqr, int32_t k)
+{
+    memmove(&hqr->offsets[k], &hqr->offsets[k + 1], (hqr->offsets_no - k - 1) * sizeof(hqr_offset_t));
+    hqr->offsets_no--;
+}
+
+
+/* Keeps the index in step with the entry list, after the entries from
+   first on have moved by delta. */
+static void
+hqr_offsets_shift(hqr_t *hqr, int32_t first, int32_t delta)
+{
+    int32_t i;
+
+    for (i = 0; i < hqr->offsets_no; i++) {
+	if (hqr->offsets[i].entry >= first)
+		hqr->offsets[i].entry += delta;
+    }
+}
+
+
+static void
+hqr_offsets_clear(hqr_t *hqr)
 {
-    if (hqr_offsets != NULL) {
-	free(hqr_offsets);
-	hqr_offsets = NULL;
+    if (hqr->offsets != NULL) {
+	free(hqr->offsets);
+	hqr->offsets = NULL;
     }
 
-    hqr_offsets_no = 0;
+    hqr->offsets_no = hqr->offsets_size = 0;
+}
+
+
+/* Returns the entry whose header is at the given offset of the loaded
+   file, or -1 if there is none. Pointers give the entry they point to. */
+int32_t
+hqr_find_offset(hqr_t *hqr, int32_t offset)
+{
+    int32_t i;
+
+    if (hqr == NULL)
+	return UNUSED;
+
+    i = hqr_find_same_offset(hqr, offset);
+    if ((i == UNUSED) || (hqr->offsets[i].entry >= hqr->entries_no))
+	return UNUSED;
 
+    return hqr->offsets[i].entry;
 }
 
 
@@ -210,22 +384,6 @@ hqr_replace_parent(hqr_t *hqr, int32_t old, int32_t new)
 #endif
 
 
-static int32_t
-hqr_find_next_offset(int32_t offset)
-{
-    int32_t i, ret = UNUSED;
-
-    for (i = 0; i < hqr_offsets_no; i++) {
-	if (hqr_offsets[i].offset > offset) {
-		ret = hqr_offsets[i].offset;
-		break;
-	}
-    }
-
-    return ret;
-}
-
-
 #if 0
 static int32_t
 hqr_find_parent(hqr_t *hqr, int32_t offset)
@@ -248,7 +406,7 @@ static void
 hqr_file_close(hqr_t *hqr)
 {
     if (hqr == NULL)
-	return 0;
+	return;
 
     if (hqr->file != NULL) {
 	fclose(hqr->file);
@@ -257,489 +415,2729 @@ hqr_file_close(hqr_t *hqr)
 }
 
 
+/* Frees the decompressed copy of an entry or child, unless it is the data
+   field itself, as it is for stored ones. */
+static void
+hqr_dec_free(hqr_common_t *hc)
+{
+    if ((hc->dec != NULL) && (hc->dec != hc->data))
+	free(hc->dec);
+
+    hc->dec = NULL;
+}
+
+
+/* Allocates len bytes from the arena, 8-byte aligned. */
+static void *
+hqr_arena_alloc(hqr_t *hqr, int32_t len)
+{
+    hqr_block_t *b = hqr->arena;
+    int32_t size;
+    uint8_t *p;
+
+    len = (len + 7) & ~7;
+
+    if ((b == NULL) || (len > (b->size - b->used))) {
+	size = (b == NULL) ? HQR_BLOCK_SIZE : (b->size << 1);
+	if (size > HQR_BLOCK_MAX)
+		size = HQR_BLOCK_MAX;
+	if (size < len)
+		size = len;
+
+	b = (hqr_block_t *) malloc(sizeof(hqr_block_t) + size);
+	if (b == NULL)
+		return NULL;
+
+	b->next = hqr->arena;
+	b->used = 0;
+	b->size = size;
+	hqr->arena = b;
+    }
+
+    p = (uint8_t *) (b + 1) + b->used;
+    b->used += len;
+
+    return p;
+}
+
+
 static int32_t
-hqr_load_internal(hqr_t *hqr, char *path)
+hqr_arena_owns(hqr_t *hqr, void *p)
 {
-    int32_t i, j;
-    int32_t file_len, offset;
-    int32_t next_e, next_c;
-    int32_t prev_o, next_o;
-    hqr_entry_t he;
-    hqr_offset_t ho;
-    hqr_common_t hc;
+    hqr_block_t *b;
 
-    if (hqr->file != NULL)
-	hqr_file_close(hqr);
+    for (b = hqr->arena; b != NULL; b = b->next) {
+	if (((uint8_t *) p >= (uint8_t *) (b + 1)) && ((uint8_t *) p < ((uint8_t *) (b + 1) + b->size)))
+		return 1;
+    }
 
-    hqr->file = fopen(path, "rb");
-    if (hqr->file == NULL)
-	return 0;
+    return 0;
+}
 
-    fseek(hqr->file, 0, SEEK_END);
-    file_len = ftell(hqr->file);
-    if (file_len < 4)
-	return 0;
 
-    /* Pass 1: Load the main entries. */
-    i = 0;
-    while (1) {
-	fseek(hqr->file, i << 2, SEEK_SET);
-	fread(&offset, 1, 4, hqr->file);
-	prev_o = hqr_find_same_offset(offset);
-	if (offset != 0x00000000) {
-		/* Not a NULL entry. */
-		if (prev_o == UNUSED) {
-			/* New offset, so this is a normal entry. */
-			hqr_offset_init(&ho);
-			ho.offset = offset;
-			ho.entry = i;
-			next_o = hqr_next_offset(ho);
-			if (next_o == UNUSED) {
-				printf("ASSERT: Failed to allocate next offset\n");
-				return 0;
-			}
+static void
+hqr_arena_free(hqr_t *hqr)
+{
+    hqr_block_t *b;
 
-			hqr_entry_init(&he);
-			fseek(hqr->file, offset, SEEK_SET);
-			if (offset == file_len) {
-				/* EOF entry. */
-				he.entry_type = ENTRY_EOF;
-				printf("%05i (%08X): EOF\n", i, offset);
-				break;
-			} else {
-				/* Normal entry. */
-				he.entry_type = ENTRY_NORMAL;
-				he.offset = offset;
-				fread(&he.dec_size, 1, 4, hqr->file);
-				fread(&he.comp_size, 1, 4, hqr->file);
-				fread(&he.comp_type, 1, 2, hqr->file);
-				if ((he.comp_type < 0) || (he.comp_type > 2))
-					printf("ASSERT: Invalid compression type %i for entry %i\n", hqr_entries[next_e].comp_type, next_e);
-				else if ((he.comp_type == 0) && (he.dec_size != he.comp_size))
-					printf("ASSERT: Size mismatch in a non-compressed entry\n");
-				he.data = (uint8_t *) malloc(he.comp_size);
-				fread(he.data, 1, he.comp_size, hqr->file);
-				printf("%05i (%08X): NORMAL: %08X, %08X, %5s\n", i, offset, he.dec_size, he.comp_size,
-				       comp_types[he.comp_type]);
-			}
-		} else {
-			/* Pointer to a previous entry. */
-			he.entry_type = ENTRY_POINTER;
-			he.offset = offset;
-			he.parent = hqr_offsets[prev_o].entry;
-			printf("%05i (%08X): PTR   : %05i\n", i, offset, he.parent);
-		}
-	} else {
-		/* NULL entry. */
-		he.entry_type = ENTRY_NULL;
-		printf("%05i (%08X): NULL\n", i, offset);
-	}
+    while (hqr->arena != NULL) {
+	b = hqr->arena;
+	hqr->arena = b->next;
+	free(b);
+    }
+}
 
-	next_e = hqr_next_entry(hqr, he);
-	if (next_e == UNUSED) {
-		printf("ASSERT: Failed to allocate next entry\n");
+
+/* Reads len bytes at offset, from the mapping if there is one and from the
+   file otherwise. Returns 0 if they are not all there. */
+static int32_t
+hqr_read(hqr_t *hqr, int32_t offset, void *buf, int32_t len)
+{
+    if (hqr->map != NULL) {
+	if ((offset < 0) || (len < 0) || (offset > (hqr->map_size - len)))
 		return 0;
-	}
 
-	i++;
+	memcpy(buf, hqr->map + offset, len);
+	return 1;
+    }
 
-	if ((i << 2) == hqr_offsets[0].offset) {
-		printf("ASSERT: No EOF entry in HQR file\n");
-		break;
-	}
+    if (fseek(hqr->file, offset, SEEK_SET) != 0)
+	return 0;
+
+    return (fread(buf, 1, len, hqr->file) == (size_t) len);
+}
+
+
+/* Data of an entry or child: a pointer into the mapping if there is one,
+   so nothing is copied, or a copy read from the file otherwise. */
+static uint8_t *
+hqr_read_data(hqr_t *hqr, int32_t offset, int32_t len)
+{
+    uint8_t *data;
+
+    if (hqr->map != NULL) {
+	if ((offset < 0) || (len < 0) || (offset > (hqr->map_size - len)))
+		return NULL;
+
+	return hqr->map + offset;
     }
 
-    /* Pass 2: Load the children. */
-    for (i = 0; i < hqr->entries_no; i++) {
-	if (hqr->entries[i].entry_type == ENTRY_NORMAL) {
-		hqr->entries[i].tbl_next_off = hqr_find_next_offset(hqr->entries[i].offset);
-		if (hqr->entries[i].tbl_next_off == UNUSED) {
-			printf("ASSERT: hqr->entries[i].tbl_next_off = UNUSED\n");
-			return;
-		}
-		hqr->entries[i].size_next_off = hqr->entries[i].offset + hqr->entries[i].comp_size + 10;
-
-		if (hqr->entries[i].tbl_next_off != hqr->entries[i].size_next_off) {
-			j = 0;
-			he = hqr->entries[i];
-			hqr_child_init(&hc);
-			while (1) {
-				if (j == 0)		/* Use parent size_next_off. */
-					hc.offset = he.size_next_off;
-				else			/* Use previous child size_next_off. */
-					hc.offset = hc.size_next_off;
-				fseek(hqr_file, hc.offset, SEEK_SET);
-				hc.tbl_next_off = he.tbl_next_off;
-				fread(&hc.dec_size, 1, 4, hqr->file);
-				fread(&hc.comp_size, 1, 4, hqr->file);
-				hc.size_next_off = hc.offset + hc.comp_size + 10;
-				fread(&hc.comp_type, 1, 2, hqr->file);
-				if ((hc.comp_type < 0) || (hc.comp_type > 2))
-					printf("ASSERT: Invalid compression type %i for entry %i.%i\n", hc.comp_type, i, j);
-				else if ((hc.comp_type == 0) && (hc.dec_size != hc.comp_size))
-					printf("ASSERT: Size mismatch in a non-compressed entry\n");
-				hc.data = (uint8_t *) malloc(hc.comp_size);
-				fread(hc.data, 1, hc.comp_size, hqr->file);
-				printf("%05i.%05i (%08X): NORMAL: %08X, %08X, %s\n", i, j, hc.offset, hc.dec_size, hc.comp_size,
-				       comp_types[hc.comp_type]);
-
-				next_c = hqr_next_child(hqr, i, hc);
-				if (next_c == UNUSED) {
-					printf("ASSERT: Failed to allocate next child for entry %i\n", i);
-					return 0;
-				}
-
-				j++;
-
-				printf("%08X, %08X\n", hc.size_next_off, hc.tbl_next_off);
-				if (hc.size_next_off == hc.tbl_next_off)
-					break;
-			}
-		}
-	}
+    data = (uint8_t *) malloc(len + 1);
+    if ((data != NULL) && !hqr_read(hqr, offset, data, len)) {
+	free(data);
+	data = NULL;
     }
 
-    return 1;
+    return data;
 }
 
 
-/* Wrapper to make sure we always clean up hqr_offets after loading a file. */
-int32_t
-hqr_load(hqr_t *hqr, char *path)
+/* Frees a field of an entry or child, unless it points into the mapping
+   or into the arena. The data of an empty entry at the end of the file
+   points just past the end of the mapping. */
+static void
+hqr_data_free(hqr_t *hqr, uint8_t *data)
 {
-    int32_t ret;
+    if ((data == NULL) ||
+	((hqr->map != NULL) && (data >= hqr->map) && (data <= (hqr->map + hqr->map_size))) ||
+	hqr_arena_owns(hqr, data))
+	return;
+
+    free(data);
+}
 
-    if (hqr == NULL)
-	return 0;
 
-    ret = hqr_load_internal(hqr, path);
+/* Resizes the children array of an entry to n children. One in the arena
+   is copied out of it first. */
+static hqr_common_t *
+hqr_children_resize(hqr_t *hqr, hqr_entry_t *he, int32_t n)
+{
+    hqr_common_t *children;
 
-    if (hqr_offsets != NULL) {
-	free(hqr_offsets);
-	hqr_offsets = NULL;
+    if (n == 0) {
+	hqr_data_free(hqr, (uint8_t *) he->children);
+	return NULL;
     }
 
-    hqr_file_close(hqr);
+    if (!hqr_arena_owns(hqr, he->children))
+	return (hqr_common_t *) realloc(he->children, n * sizeof(hqr_common_t));
 
-    return ret;
+    children = (hqr_common_t *) malloc(n * sizeof(hqr_common_t));
+    if (children != NULL)
+	memcpy(children, he->children, ((n < he->children_no) ? n : he->children_no) * sizeof(hqr_common_t));
+
+    return children;
 }
 
 
-int32_t
-hqr_entry_delete(hqr_t *hqr int32_t entry, int32_t delete_children)
+/* Orders by offset, then by entry, so that entries with the same offset
+   come out in table order whether or not qsort() is stable. */
+static int
+hqr_compare_offsets(const void *a, const void *b)
 {
-    int32_t i, new, delete, list_entry_del = 0, first_ptr = UNUSED;
-    hqr_entry_t he;
+    const hqr_offset_t *x = (const hqr_offset_t *) a, *y = (const hqr_offset_t *) b;
 
-    if (hqr == NULL)
-	return 0;
+    if (x->offset != y->offset)
+	return (x->offset > y->offset) - (x->offset < y->offset);
 
-    if (entry == UNUSED)
-	return 0;
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
 
-    if (hqr->entries[entry].entry_type == ENTRY_EOF)
+
+/* Makes the reader hold at least len bytes at offset, reading ahead
+   bytes or more at once. */
+static int32_t
+hqr_reader_fill(hqr_reader_t *r, int32_t offset, int32_t len)
+{
+    int32_t size;
+
+    if ((offset < 0) || (len < 0) || (offset > (r->file_len - len)))
 	return 0;
 
-    delete = (hqr->entries[entry].children_no == 0) || delete_children;
+    size = (len > r->ahead) ? len : r->ahead;
+    if (size > (r->file_len - offset))
+	size = r->file_len - offset;
 
-    /* Pass 1: Find all entries that point to us. */
-    if (hqr->entries[entry].entry_type == ENTRY_NORMAL) {
-	/* There are no pointers to pointers or pointers to NULL entries. */
-	for (i = 0; i < hqr->entries_no; i++) {
-		if (hqr->entries[i].parent == entry) {
-			first_ptr = i;
-			break;
-   		}
-	}
+    if (size > r->size) {
+	free(r->buf);
+	r->buf = (uint8_t *) malloc(size);
+	r->size = (r->buf == NULL) ? 0 : size;
+	r->len = 0;
+	if (r->buf == NULL)
+		return 0;
     }
 
-    if (first_ptr != UNUSED) {
-	/* If anything points to us, then do not delete the data field or children, but pass them to the
-	   pointer. */
-	for (i = first_ptr + 1; i < hqr->entries_no; i++) {
-		if (hqr->entries[i].parent == entry)
-			hqr->entries[i].parent = first_ptr;
-	}
+    r->pos = offset;
+    r->len = hqr_read(r->hqr, offset, r->buf, size) ? size : 0;
 
-	hqr->entries[first_ptr].type = ENTRY_NORMAL;
-	hqr->entries[first_ptr].dec_size = hqr->entries[entry].dec_size;
-	hqr->entries[first_ptr].comp_size = hqr->entries[entry].comp_size;
-	hqr->entries[first_ptr].data = hqr->entries[entry].data;
-	hqr->entries[first_ptr].children_no = hqr->entries[entry].children_no;
-	hqr->entries[first_ptr].children = hqr->entries[entry].children;
+    return (r->len != 0) || (size == 0);
+}
 
-	/* Clean up our own entry. */
-	hqr->entries[entry].data = NULL;
-	hqr->entries[entry].children_no = NULL;
-	hqr->entries[entry].chilren = NULL;
-	/* Force no deletion of children if we're passing ourselves to our first pointer. */
-	delete = 0;
-    }
 
-    /* Finish removing ourselves, with the data field first. */
-    if (hqr->entries[entry].data != NULL) {
-	free(hqr->entries[entry].data);
-	hqr->entries[entry].data = NULL;
-    }
+/* Reads len bytes at offset through the reader. Reads that go past the
+   buffer refill it from offset on, so that a walk in ascending offset
+   order costs one read per ahead bytes rather than one per field. Reads
+   bigger than that go straight to the file. */
+static int32_t
+hqr_reader_get(hqr_reader_t *r, int32_t offset, void *buf, int32_t len)
+{
+    if (r->hqr->map != NULL)
+	return hqr_read(r->hqr, offset, buf, len);
 
-    /* Next, the description field. */
-    if (hqr->entries[entry].desc != NULL) {
-	free(hqr->entries[entry].desc);
-	hqr->entries[entry].desc = NULL;
+    if ((offset < r->pos) || (offset > (r->pos + r->len - len))) {
+	if (len > r->ahead)
+		return hqr_read(r->hqr, offset, buf, len);
+	if (!hqr_reader_fill(r, offset, len))
+		return 0;
     }
 
-    if ((hqr->entries[entry].children_no == 0) || delete) {
-	/* Update all parents - do this here so that if we pass ourselves to our
-	   first child, we do not update parents as our entry is still going to
-	   exist. */
+    memcpy(buf, r->buf + (offset - r->pos), len);
+
+    return 1;
+}
+
+
+/* hqr_read_data() through the reader, into the arena. */
+static uint8_t *
+hqr_reader_data(hqr_reader_t *r, int32_t offset, int32_t len)
+{
+    uint8_t *data;
+
+    if (r->hqr->map != NULL)
+	return hqr_read_data(r->hqr, offset, len);
+
+    if ((len < 0) || (offset > (r->file_len - len)))
+	return NULL;
+
+    data = (uint8_t *) hqr_arena_alloc(r->hqr, len + 1);
+    if ((data != NULL) && !hqr_reader_get(r, offset, data, len))
+	data = NULL;
+
+    return data;
+}
+
+
+/* Reads the 10-byte header of an entry or child. */
+static int32_t
+hqr_reader_header(hqr_reader_t *r, hqr_common_t *hc)
+{
+    uint8_t hdr[10];
+
+    if (!hqr_reader_get(r, hc->offset, hdr, 10))
+	return 0;
+
+    memcpy(&hc->dec_size, hdr, 4);
+    memcpy(&hc->comp_size, hdr + 4, 4);
+    memcpy(&hc->comp_type, hdr + 8, 2);
+
+    return 1;
+}
+
+
+/* Prints the entries in table order, then the children. */
+static void
+hqr_print_list(hqr_t *hqr, int32_t file_len)
+{
+    hqr_entry_t *he;
+    hqr_common_t *hc;
+    int32_t i, j;
+
+    for (i = 0; i < hqr->entries_no; i++) {
+	he = &hqr->entries[i];
+	if (he->entry_type == ENTRY_NORMAL)
+		printf("%05i (%08X): NORMAL: %08X, %08X, %5s\n", i, he->offset, he->dec_size, he->comp_size,
+		       comp_types[he->comp_type]);
+	else if (he->entry_type == ENTRY_POINTER)
+		printf("%05i (%08X): PTR   : %05i\n", i, he->offset, he->parent);
+	else
+		printf("%05i (%08X): NULL\n", i, he->offset);
+    }
+    if (hqr->offsets[hqr->offsets_no - 1].offset == file_len)
+	printf("%05i (%08X): EOF\n", i, file_len);
+
+    for (i = 0; i < hqr->entries_no; i++) {
+	for (j = 0; j < hqr->entries[i].children_no; j++) {
+		hc = &hqr->entries[i].children[j];
+		printf("%05i.%05i (%08X): NORMAL: %08X, %08X, %s\n", i, j, hc->offset, hc->dec_size, hc->comp_size,
+		       comp_types[hc->comp_type]);
+		printf("%08X, %08X\n", hc->size_next_off, hc->tbl_next_off);
+	}
+    }
+}
+
+
+/* With lazy set, only the index is read: the offset table, the headers and
+   the children chains, and the data fields are left at NULL for
+   hqr_entry_get() to read when they are first needed.
+
+   The offset table is read in one go, then the entries are visited in
+   ascending offset order, each header followed by its data and its
+   children, so that all of it comes through a few large reads. */
+static int32_t
+hqr_load_internal(hqr_t *hqr, int32_t file_len, int lazy)
+{
+    int32_t i, j, k;
+    int32_t offset;
+    int32_t next_e;
+    int32_t first, next_o;
+    hqr_entry_t he, *pe;
+    hqr_offset_t ho;
+    hqr_common_t hc;
+    hqr_reader_t r;
+    int32_t ret = 0;
+
+    hqr_offsets_clear(hqr);
+
+    if (file_len < 4)
+	return 0;
+
+    memset(&r, 0x00, sizeof(hqr_reader_t));
+    r.hqr = hqr;
+    r.file_len = file_len;
+    r.ahead = lazy ? HQR_INDEX_READ_SIZE : HQR_READ_SIZE;
+
+    /* The table ends where the first entry starts. */
+    if (!hqr_reader_get(&r, 0, &offset, 4))
+	return 0;
+    if ((hqr->map == NULL) && (offset > 4) && (offset <= file_len) && !hqr_reader_fill(&r, 0, offset & ~3))
+	goto done;
+
+    /* Pass 1: Read the offset table. Every offset but 0 goes into the
+       index, with the entry it is for. */
+    i = 0;
+    first = 0;
+    while (1) {
+	hqr_entry_init(&he);
+	if (!hqr_reader_get(&r, i << 2, &offset, 4)) {
+		printf("ASSERT: Truncated offset table\n");
+		goto done;
+	}
+	if (offset != 0x00000000) {
+		/* Not a NULL entry. */
+		if (first == 0)
+			first = offset;
+
+		hqr_offset_init(&ho);
+		ho.offset = offset;
+		ho.entry = hqr->entries_no;
+		next_o = hqr_next_offset(hqr, ho);
+		if (next_o == UNUSED) {
+			printf("ASSERT: Failed to allocate next offset\n");
+			goto done;
+		}
+
+		if (offset == file_len) {
+			/* EOF entry. */
+			he.entry_type = ENTRY_EOF;
+			break;
+		} else {
+			/* Normal entry, unless another one has the same offset,
+			   its header is read in pass 2. */
+			he.entry_type = ENTRY_NORMAL;
+			he.offset = offset;
+		}
+	} else {
+		/* NULL entry. */
+		he.entry_type = ENTRY_NULL;
+	}
+
+	next_e = hqr_next_entry(hqr, he);
+	if (next_e == UNUSED) {
+		printf("ASSERT: Failed to allocate next entry\n");
+		goto done;
+	}
+
+	i++;
+
+	if ((i << 2) == first) {
+		printf("ASSERT: No EOF entry in HQR file\n");
+		break;
+	}
+    }
+
+    /* Sorting the index brings the entries with the same offset together:
+       the first one of them in the table is a normal entry, and the others
+       are pointers to it. Only the first one stays in the index. */
+    qsort(hqr->offsets, hqr->offsets_no, sizeof(hqr_offset_t), hqr_compare_offsets);
+
+    for (j = k = 0; k < hqr->offsets_no; k++) {
+	if ((j > 0) && (hqr->offsets[k].offset == hqr->offsets[j - 1].offset)) {
+		pe = &hqr->entries[hqr->offsets[k].entry];
+		pe->entry_type = ENTRY_POINTER;
+		pe->parent = hqr->offsets[j - 1].entry;
+	} else
+		hqr->offsets[j++] = hqr->offsets[k];
+    }
+    hqr->offsets_no = j;
+
+    /* Pass 2: Read the headers, the data and the children, in ascending
+       offset order. The entry after each one in that order is where its
+       children end, unless free space comes first. */
+    hqr->free_size = file_len - ((hqr->entries_no + 1) << 2);
+
+    for (k = 0; k < hqr->offsets_no; k++) {
+	i = hqr->offsets[k].entry;
+	if ((i >= hqr->entries_no) || (hqr->entries[i].entry_type != ENTRY_NORMAL))
+		continue;
+
+	pe = &hqr->entries[i];
+	if ((k + 1) == hqr->offsets_no) {
+		printf("ASSERT: hqr->entries[i].tbl_next_off = UNUSED\n");
+		goto done;
+	}
+	pe->tbl_next_off = hqr->offsets[k + 1].offset;
+
+	if (!hqr_reader_header(&r, (hqr_common_t *) pe)) {
+		printf("ASSERT: Truncated header for entry %i\n", i);
+		goto done;
+	}
+	if ((pe->comp_type < 0) || (pe->comp_type > 2))
+		printf("ASSERT: Invalid compression type %i for entry %i\n", pe->comp_type, i);
+	else if ((pe->comp_type == 0) && (pe->dec_size != pe->comp_size))
+		printf("ASSERT: Size mismatch in a non-compressed entry\n");
+	if (!lazy)
+		pe->data = hqr_reader_data(&r, pe->offset + 10, pe->comp_size);
+	if (!lazy && (pe->data == NULL)) {
+		printf("ASSERT: Truncated data for entry %i\n", i);
+		goto done;
+	}
+	pe->size_next_off = pe->offset + pe->comp_size + 10;
+
+	if (pe->tbl_next_off != pe->size_next_off) {
+		j = 0;
+		hqr_child_init(&hc);
+		while (1) {
+			if (j == 0)		/* Use parent size_next_off. */
+				hc.offset = pe->size_next_off;
+			else			/* Use previous child size_next_off. */
+				hc.offset = hc.size_next_off;
+			hc.tbl_next_off = pe->tbl_next_off;
+			if (!hqr_reader_header(&r, &hc)) {
+				printf("ASSERT: Truncated header for entry %i.%i\n", i, j);
+				goto done;
+			}
+			/* Free space left by hqr_update() ends the chain. */
+			if (hc.comp_type == HQR_FREE) {
+				pe->tbl_next_off = hc.offset;
+				for (next_e = 0; next_e < j; next_e++)
+					r.children[next_e].tbl_next_off = hc.offset;
+				break;
+			}
+			hc.size_next_off = hc.offset + hc.comp_size + 10;
+			if ((hc.comp_type < 0) || (hc.comp_type > 2))
+				printf("ASSERT: Invalid compression type %i for entry %i.%i\n", hc.comp_type, i, j);
+			else if ((hc.comp_type == 0) && (hc.dec_size != hc.comp_size))
+				printf("ASSERT: Size mismatch in a non-compressed entry\n");
+			if (!lazy)
+				hc.data = hqr_reader_data(&r, hc.offset + 10, hc.comp_size);
+			if (!lazy && (hc.data == NULL)) {
+				printf("ASSERT: Truncated data for entry %i.%i\n", i, j);
+				goto done;
+			}
+
+			if (!hqr_grow((void **) &r.children, &r.children_size, j + 1, sizeof(hqr_common_t))) {
+				printf("ASSERT: Failed to allocate next child for entry %i\n", i);
+				goto done;
+			}
+			r.children[j] = hc;
+
+			j++;
+
+			if (hc.size_next_off == hc.tbl_next_off)
+				break;
+		}
+
+		/* The whole chain goes into the arena at once. */
+		if (j > 0) {
+			pe->children = (hqr_common_t *) hqr_arena_alloc(hqr, j * sizeof(hqr_common_t));
+			if (pe->children == NULL) {
+				printf("ASSERT: Failed to allocate children for entry %i\n", i);
+				goto done;
+			}
+			memcpy(pe->children, r.children, j * sizeof(hqr_common_t));
+		}
+		pe->children_no = j;
+	}
+
+	hqr->free_size -= pe->tbl_next_off - pe->offset;
+    }
+
+    hqr_print_list(hqr, file_len);
+
+    hqr->file_size = file_len;
+    ret = 1;
+
+done:
+    free(r.children);
+    free(r.buf);
+
+    if (!ret)
+	hqr_offsets_clear(hqr);
+
+    return ret;
+}
+
+
+/* Loads a whole archive. The offset index stays in hqr->offsets, sorted,
+   for hqr_find_offset(). */
+int32_t
+hqr_load(hqr_t *hqr, char *path)
+{
+    int32_t ret;
+
+    if (hqr == NULL)
+	return 0;
+
+    if (hqr->file != NULL)
+	hqr_file_close(hqr);
+
+    hqr->file = fopen(path, "rb");
+    if (hqr->file == NULL)
+	return 0;
+
+    fseek(hqr->file, 0, SEEK_END);
+    ret = hqr_load_internal(hqr, ftell(hqr->file), 0);
+
+    hqr_file_close(hqr);
+
+    return ret;
+}
+
+
+/* Index-only load: like hqr_load(), but no entry or child data is read,
+   so the time it takes depends on the number of entries rather than on
+   the size of the archive. The file stays open until hqr_close(), and
+   hqr_entry_get() reads the data of an entry when it is first asked for. */
+int32_t
+hqr_load_index(hqr_t *hqr, char *path)
+{
+    int32_t ret;
+
+    if (hqr == NULL)
+	return 0;
+
+    if (hqr->file != NULL)
+	hqr_file_close(hqr);
+
+    hqr->file = fopen(path, "rb");
+    if (hqr->file == NULL)
+	return 0;
+
+    fseek(hqr->file, 0, SEEK_END);
+    ret = hqr_load_internal(hqr, ftell(hqr->file), 1);
+
+    if (!ret)
+	hqr_file_close(hqr);
+
+    return ret;
+}
+
+
+static void
+hqr_unmap(hqr_t *hqr)
+{
+    if (hqr->map == NULL)
+	return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(hqr->map);
+#else
+    munmap(hqr->map, hqr->map_size);
+#endif
+
+    hqr->map = NULL;
+    hqr->map_size = 0;
+}
+
+
+/* Like hqr_load(), but maps the file into memory instead of reading it, and
+   the data fields of the entries and children point into the mapping rather
+   than to copies - stored entries then cost no memory of their own at all.
+   The mapping is read-only and stays until hqr_close(), so an archive can
+   only be mapped into an hqr_t that does not have one yet. */
+int32_t
+hqr_load_mmap(hqr_t *hqr, char *path)
+{
+    int32_t ret;
+#ifdef _WIN32
+    HANDLE file, mapping;
+    DWORD size_high;
+#else
+    struct stat st;
+    void *map;
+    int fd;
+#endif
+
+    if ((hqr == NULL) || (hqr->map != NULL))
+	return 0;
+
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+	return 0;
+
+    hqr->map_size = (int32_t) GetFileSize(file, &size_high);
+    if ((size_high != 0) || (hqr->map_size < 4)) {
+	CloseHandle(file);
+	hqr->map_size = 0;
+	return 0;
+    }
+
+    /* The view keeps the mapping alive once both handles are closed. */
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL) {
+	hqr->map = (uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+    }
+    CloseHandle(file);
+#else
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return 0;
+
+    if ((fstat(fd, &st) != 0) || (st.st_size < 4) || (st.st_size > INT32_MAX)) {
+	close(fd);
+	return 0;
+    }
+
+    hqr->map_size = (int32_t) st.st_size;
+    map = mmap(NULL, hqr->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    hqr->map = (map == MAP_FAILED) ? NULL : (uint8_t *) map;
+#endif
+
+    if (hqr->map == NULL) {
+	hqr->map_size = 0;
+	return 0;
+    }
+
+    ret = hqr_load_internal(hqr, hqr->map_size, 0);
+
+    return ret;
+}
+
+
+/* Reads the data of an entry or child that a lazy load left out. */
+static int32_t
+hqr_entry_load(hqr_t *hqr, hqr_common_t *hc)
+{
+    if (hc->data != NULL)
+	return 1;
+
+    if (hqr->file == NULL)
+	return 0;
+
+    hc->data = hqr_read_data(hqr, hc->offset + 10, hc->comp_size);
+
+    return (hc->data != NULL);
+}
+
+
+/* Decompresses one entry or child into its dec field. A stored one is
+   used as it is. */
+static int32_t
+hqr_decompress_one(hqr_common_t *hc)
+{
+    uint8_t *dec;
+
+    if ((hc->dec != NULL) || (hc->data == NULL))
+	return 1;
+
+    if (hc->comp_type == COMPRESS_STORE) {
+	hc->dec = hc->data;
+	return (hc->comp_size == hc->dec_size);
+    }
+
+    dec = (uint8_t *) malloc(hc->dec_size + 1);
+    if (dec == NULL)
+	return 0;
+
+    if (decompress_safe(hc->comp_type, (char *) dec, hc->dec_size, (char *) hc->data, hc->comp_size) != hc->dec_size) {
+	free(dec);
+	return 0;
+    }
+
+    hc->dec = dec;
+
+    return 1;
+}
+
+
+static void *
+hqr_pool_thread(void *priv)
+{
+    hqr_pool_t *pool = (hqr_pool_t *) priv;
+    int32_t i;
+
+    while (1) {
+	pthread_mutex_lock(&pool->mutex);
+	i = pool->next++;
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (i >= pool->jobs_no)
+		break;
+
+	if (!hqr_decompress_one(pool->jobs[i])) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->failed++;
+		pthread_mutex_unlock(&pool->mutex);
+	}
+    }
+
+    return NULL;
+}
+
+
+static int
+hqr_compare_jobs(const void *a, const void *b)
+{
+    const hqr_common_t *x = *(const hqr_common_t **) a, *y = *(const hqr_common_t **) b;
+
+    return (y->dec_size > x->dec_size) - (y->dec_size < x->dec_size);
+}
+
+
+static int
+hqr_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+
+    return (int) si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n < 1) ? 1 : (int) n;
+#endif
+}
+
+
+/* Decompresses every entry and child into its dec field, on the given
+   number of threads (0 for one per CPU). Entries that already have one are
+   left alone, stored entries share their data field, and pointers share
+   the dec field of their parent, so nothing is decoded twice. Returns 0 if
+   anything failed to decode, but decodes everything else regardless. */
+int32_t
+hqr_decompress_all(hqr_t *hqr, int threads)
+{
+    hqr_pool_t pool;
+    pthread_t *tids;
+    int32_t i, j;
+    int started = 0;
+
+    if (hqr == NULL)
+	return 0;
+
+    hqr->heap = 1;
+
+    memset(&pool, 0x00, sizeof(hqr_pool_t));
+
+    for (i = 0; i < hqr->entries_no; i++) {
+	if (hqr->entries[i].entry_type == ENTRY_NORMAL)
+		pool.jobs_no += 1 + hqr->entries[i].children_no;
+    }
+
+    pool.jobs = (hqr_common_t **) malloc((pool.jobs_no + 1) * sizeof(hqr_common_t *));
+    if (pool.jobs == NULL)
+	return 0;
+
+    pool.jobs_no = 0;
+    for (i = 0; i < hqr->entries_no; i++) {
+	if (hqr->entries[i].entry_type != ENTRY_NORMAL)
+		continue;
+
+	/* hqr_common_t has the same layout as hqr_entry_t. */
+	pool.jobs[pool.jobs_no++] = (hqr_common_t *) &hqr->entries[i];
+	for (j = 0; j < hqr->entries[i].children_no; j++)
+		pool.jobs[pool.jobs_no++] = &hqr->entries[i].children[j];
+    }
+
+    /* After hqr_load_index(), the data is read here first, as the file can
+       only be read from one thread. */
+    for (i = 0; i < pool.jobs_no; i++) {
+	if ((pool.jobs[i]->dec == NULL) && !hqr_entry_load(hqr, pool.jobs[i]))
+		pool.failed++;
+    }
+
+    /* Biggest first, so no thread is left with a big one at the end. */
+    qsort(pool.jobs, pool.jobs_no, sizeof(hqr_common_t *), hqr_compare_jobs);
+
+    if (threads <= 0)
+	threads = hqr_cpu_count();
+    if (threads > pool.jobs_no)
+	threads = pool.jobs_no;
+
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    tids = (pthread_t *) malloc((threads + 1) * sizeof(pthread_t));
+    if ((tids != NULL) && (threads > 1)) {
+	for (started = 0; started < (threads - 1); started++) {
+		if (pthread_create(&tids[started], NULL, hqr_pool_thread, &pool) != 0)
+			break;
+	}
+    }
+
+    /* The calling thread is one of the workers. */
+    hqr_pool_thread(&pool);
+
+    for (i = 0; i < started; i++)
+	pthread_join(tids[i], NULL);
+
+    pthread_mutex_destroy(&pool.mutex);
+    free(tids);
+    free(pool.jobs);
+
+    for (i = 0; i < hqr->entries_no; i++) {
+	if ((hqr->entries[i].entry_type == ENTRY_POINTER) && (hqr->entries[i].parent != UNUSED))
+		hqr->entries[i].dec = hqr->entries[hqr->entries[i].parent].dec;
+    }
+
+    return (pool.failed == 0);
+}
+
+
+/* Decompresses an entry or child on its own. If its data has not been
+   read yet, it is read into the end of the decompression buffer and
+   decompressed in place, so that no copy of the compressed data is
+   kept; it can always be read again. */
+static int32_t
+hqr_entry_decode(hqr_t *hqr, hqr_common_t *hc)
+{
+    int32_t size;
+    uint8_t *buf, *dec;
+
+    if (hc->dec != NULL)
+	return 1;
+
+    if ((hc->data != NULL) || (hc->comp_type == COMPRESS_STORE) || (hqr->file == NULL))
+	return hqr_entry_load(hqr, hc) && hqr_decompress_one(hc);
+
+    size = hc->dec_size + decompress_margin(hc->comp_type, hc->dec_size);
+    if (size < hc->comp_size)
+	size = hc->comp_size;
+
+    buf = (uint8_t *) malloc(size + 1);
+    if (buf == NULL)
+	return 0;
+
+    if (!hqr_read(hqr, hc->offset + 10, buf + size - hc->comp_size, hc->comp_size) ||
+	(decompress_in_place(hc->comp_type, (char *) buf, size, hc->comp_size) != hc->dec_size)) {
+	free(buf);
+	return 0;
+    }
+
+    /* Only trims the margin, so the untrimmed buffer does if that fails. */
+    dec = (uint8_t *) realloc(buf, hc->dec_size + 1);
+    hc->dec = (dec != NULL) ? dec : buf;
+
+    return 1;
+}
+
+
+/* Returns the data of an entry, or with child not -1, of one of its
+   children, reading it from the file first after hqr_load_index(). With
+   decompress set, returns the decompressed data, which stays in the dec
+   field. A pointer gives the data of its parent. Returns NULL for a NULL
+   or EOF entry and on errors. Not safe to call from several threads. */
+uint8_t *
+hqr_entry_get(hqr_t *hqr, int32_t entry, int32_t child, int decompress)
+{
+    hqr_common_t *hc;
+    int32_t ptr = UNUSED;
+
+    if ((hqr == NULL) || (entry < 0) || (entry >= hqr->entries_no))
+	return NULL;
+
+    hqr->heap = 1;
+
+    if (hqr->entries[entry].entry_type == ENTRY_POINTER) {
+	ptr = entry;
+	entry = hqr->entries[entry].parent;
+	if ((entry < 0) || (entry >= hqr->entries_no))
+		return NULL;
+    }
+
+    if (hqr->entries[entry].entry_type != ENTRY_NORMAL)
+	return NULL;
+
+    if (child == UNUSED)
+	hc = (hqr_common_t *) &hqr->entries[entry];
+    else if ((child >= 0) && (child < hqr->entries[entry].children_no))
+	hc = &hqr->entries[entry].children[child];
+    else
+	return NULL;
+
+    if (!decompress)
+	return hqr_entry_load(hqr, hc) ? hc->data : NULL;
+
+    if (!hqr_entry_decode(hqr, hc))
+	return NULL;
+
+    if ((ptr != UNUSED) && (child == UNUSED))
+	hqr->entries[ptr].dec = hc->dec;
+
+    return hc->dec;
+}
+
+
+/* Sets up the cache of decompressed entries of hqr_cache_get(), which
+   keeps at most budget bytes of them, the least recently used ones going
+   first. Each shard has 1/HQR_CACHE_SHARDS of the budget, so an entry
+   bigger than that is decompressed every time. A cache that is already
+   there is flushed and given the new budget. */
+int32_t
+hqr_cache_init(hqr_t *hqr, int64_t budget)
+{
+    hqr_cache_t *cache;
+    int i;
+
+    if ((hqr == NULL) || (budget <= 0))
+	return 0;
+
+    if (hqr->cache == NULL) {
+	cache = (hqr_cache_t *) malloc(sizeof(hqr_cache_t));
+	if (cache == NULL)
+		return 0;
+
+	memset(cache, 0x00, sizeof(hqr_cache_t));
+	for (i = 0; i < HQR_CACHE_SHARDS; i++)
+		pthread_mutex_init(&cache->shards[i].mutex, NULL);
+	pthread_mutex_init(&cache->file_mutex, NULL);
+
+	hqr->cache = cache;
+    } else
+	hqr_cache_flush(hqr);
+
+    for (i = 0; i < HQR_CACHE_SHARDS; i++)
+	hqr->cache->shards[i].budget = budget / HQR_CACHE_SHARDS;
+
+    return 1;
+}
+
+
+static uint32_t
+hqr_cache_hash(int64_t key)
+{
+    return (uint32_t) (((uint64_t) key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+
+static void
+hqr_shard_link(hqr_shard_t *s, hqr_cached_t *o)
+{
+    uint32_t b = (hqr_cache_hash(o->key) / HQR_CACHE_SHARDS) & (s->table_size - 1);
+
+    o->chain = s->table[b];
+    s->table[b] = o;
+
+    o->prev = NULL;
+    o->next = s->head;
+    if (s->head != NULL)
+	s->head->prev = o;
+    else
+	s->tail = o;
+    s->head = o;
+
+    o->cached = 1;
+    s->count++;
+    s->bytes += sizeof(hqr_cached_t) + o->size;
+}
+
+
+static void
+hqr_shard_unlink(hqr_shard_t *s, hqr_cached_t *o)
+{
+    uint32_t b = (hqr_cache_hash(o->key) / HQR_CACHE_SHARDS) & (s->table_size - 1);
+    hqr_cached_t **pp;
+
+    for (pp = &s->table[b]; *pp != o; pp = &(*pp)->chain)
+	;
+    *pp = o->chain;
+
+    if (o->prev != NULL)
+	o->prev->next = o->next;
+    else
+	s->head = o->next;
+    if (o->next != NULL)
+	o->next->prev = o->prev;
+    else
+	s->tail = o->prev;
+
+    o->cached = 0;
+    s->count--;
+    s->bytes -= sizeof(hqr_cached_t) + o->size;
+}
+
+
+static hqr_cached_t *
+hqr_shard_find(hqr_shard_t *s, int64_t key)
+{
+    hqr_cached_t *o;
+
+    if (s->table == NULL)
+	return NULL;
+
+    o = s->table[(hqr_cache_hash(key) / HQR_CACHE_SHARDS) & (s->table_size - 1)];
+    while ((o != NULL) && (o->key != key))
+	o = o->chain;
+
+    return o;
+}
+
+
+/* Doubles the hash table of a shard, relinking everything in LRU order. */
+static int32_t
+hqr_shard_grow(hqr_shard_t *s)
+{
+    hqr_cached_t *o, *tail = s->tail;
+    hqr_cached_t **table;
+    int32_t size = (s->table_size == 0) ? HQR_CACHE_BUCKETS : (s->table_size << 1);
+
+    table = (hqr_cached_t **) malloc(size * sizeof(hqr_cached_t *));
+    if (table == NULL)
+	return 0;
+    memset(table, 0x00, size * sizeof(hqr_cached_t *));
+
+    free(s->table);
+    s->table = table;
+    s->table_size = size;
+    s->head = s->tail = NULL;
+    s->count = 0;
+    s->bytes = 0;
+
+    while (tail != NULL) {
+	o = tail;
+	tail = tail->prev;
+	hqr_shard_link(s, o);
+    }
+
+    return 1;
+}
+
+
+/* Drops the least recently used objects nobody holds until the shard is
+   within its budget. */
+static void
+hqr_shard_evict(hqr_shard_t *s)
+{
+    hqr_cached_t *o = s->tail, *prev;
+
+    while ((o != NULL) && (s->bytes > s->budget)) {
+	prev = o->prev;
+	if (o->refs == 0) {
+		hqr_shard_unlink(s, o);
+		free(o);
+	}
+	o = prev;
+    }
+}
+
+
+/* Decompresses an entry or child into a new cache object. The data is
+   only read, so this can run on several threads at once; after an
+   index-only load, the file is read under the file lock of the cache, into
+   the end of the object to decompress it in place. */
+static hqr_cached_t *
+hqr_cache_decode(hqr_t *hqr, hqr_common_t *hc)
+{
+    hqr_cached_t *o, *n;
+    uint8_t *out;
+    int32_t size = hc->dec_size, ok;
+
+    if ((hc->comp_type == COMPRESS_STORE) && (hc->comp_size != hc->dec_size))
+	return NULL;
+
+    if ((hc->data == NULL) && (hc->comp_type != COMPRESS_STORE))
+	size = hc->dec_size + decompress_margin(hc->comp_type, hc->dec_size);
+    if (size < hc->comp_size)
+	size = hc->comp_size;
+
+    o = (hqr_cached_t *) malloc(sizeof(hqr_cached_t) + size + 1);
+    if (o == NULL)
+	return NULL;
+    memset(o, 0x00, sizeof(hqr_cached_t));
+    o->size = hc->dec_size;
+    out = (uint8_t *) (o + 1);
+
+    if (hc->data != NULL) {
+	if (hc->comp_type == COMPRESS_STORE) {
+		memcpy(out, hc->data, hc->dec_size);
+		ok = 1;
+	} else
+		ok = (decompress_safe(hc->comp_type, (char *) out, hc->dec_size, (char *) hc->data, hc->comp_size) == hc->dec_size);
+    } else if (hqr->file != NULL) {
+	pthread_mutex_lock(&hqr->cache->file_mutex);
+	ok = hqr_read(hqr, hc->offset + 10, out + size - hc->comp_size, hc->comp_size);
+	pthread_mutex_unlock(&hqr->cache->file_mutex);
+
+	if (ok && (hc->comp_type != COMPRESS_STORE))
+		ok = (decompress_in_place(hc->comp_type, (char *) out, size, hc->comp_size) == hc->dec_size);
+	if (ok && (size > hc->dec_size)) {
+		n = (hqr_cached_t *) realloc(o, sizeof(hqr_cached_t) + hc->dec_size + 1);
+		if (n != NULL)
+			o = n;
+	}
+    } else
+	ok = 0;
+
+    if (!ok) {
+	free(o);
+	return NULL;
+    }
+
+    return o;
+}
+
+
+/* Returns the decompressed data of an entry, or with child not -1, of one
+   of its children, from the cache set up by hqr_cache_init(), and its
+   size in *size if size is not NULL. A pointer gives the same object as
+   the entry it points to. The data stays valid until it is handed back
+   with hqr_cache_release(), and has to be before the archive is edited or
+   freed. Safe to call from several threads at once, as long as nothing
+   else touches the archive meanwhile. Returns NULL for a NULL or EOF
+   entry and on errors. */
+uint8_t *
+hqr_cache_get(hqr_t *hqr, int32_t entry, int32_t child, int32_t *size)
+{
+    hqr_common_t *hc;
+    hqr_cached_t *o, *found;
+    hqr_shard_t *s;
+    int64_t key;
+    int shard;
+
+    if ((hqr == NULL) || (hqr->cache == NULL) || (entry < 0) || (entry >= hqr->entries_no))
+	return NULL;
+
+    if (hqr->entries[entry].entry_type == ENTRY_POINTER) {
+	entry = hqr->entries[entry].parent;
+	if ((entry < 0) || (entry >= hqr->entries_no))
+		return NULL;
+    }
+
+    if (hqr->entries[entry].entry_type != ENTRY_NORMAL)
+	return NULL;
+
+    if (child == UNUSED)
+	hc = (hqr_common_t *) &hqr->entries[entry];
+    else if ((child >= 0) && (child < hqr->entries[entry].children_no))
+	hc = &hqr->entries[entry].children[child];
+    else
+	return NULL;
+
+    key = ((int64_t) entry << 32) | (uint32_t) (child + 1);
+    shard = hqr_cache_hash(key) % HQR_CACHE_SHARDS;
+    s = &hqr->cache->shards[shard];
+
+    pthread_mutex_lock(&s->mutex);
+    o = hqr_shard_find(s, key);
+    if (o != NULL) {
+	o->refs++;
+	s->hits++;
+
+	/* Move it to the front of the LRU list. */
+	if (o != s->head) {
+		o->prev->next = o->next;
+		if (o->next != NULL)
+			o->next->prev = o->prev;
+		else
+			s->tail = o->prev;
+		o->prev = NULL;
+		o->next = s->head;
+		s->head->prev = o;
+		s->head = o;
+	}
+    } else
+	s->misses++;
+    pthread_mutex_unlock(&s->mutex);
+
+    if (o == NULL) {
+	/* Decompressed without the lock, so another thread may have
+	   done the same meanwhile; the first one in wins. */
+	o = hqr_cache_decode(hqr, hc);
+	if (o == NULL)
+		return NULL;
+	o->key = key;
+	o->shard = shard;
+	o->refs = 1;
+
+	pthread_mutex_lock(&s->mutex);
+	found = hqr_shard_find(s, key);
+	if (found != NULL) {
+		free(o);
+		o = found;
+		o->refs++;
+	} else if ((s->count < s->table_size) || hqr_shard_grow(s)) {
+		hqr_shard_link(s, o);
+		hqr_shard_evict(s);
+	}
+	pthread_mutex_unlock(&s->mutex);
+    }
+
+    if (size != NULL)
+	*size = o->size;
+
+    return (uint8_t *) (o + 1);
+}
+
+
+/* Hands back data from hqr_cache_get(). */
+void
+hqr_cache_release(hqr_t *hqr, uint8_t *dec)
+{
+    hqr_cached_t *o;
+    hqr_shard_t *s;
+
+    if ((hqr == NULL) || (hqr->cache == NULL) || (dec == NULL))
+	return;
+
+    o = (hqr_cached_t *) dec - 1;
+    s = &hqr->cache->shards[o->shard];
+
+    pthread_mutex_lock(&s->mutex);
+    o->refs--;
+    if (!o->cached) {
+	if (o->refs == 0)
+		free(o);
+    } else
+	hqr_shard_evict(s);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+
+/* Empties the cache. Objects that are still held are freed when they are
+   released. */
+void
+hqr_cache_flush(hqr_t *hqr)
+{
+    hqr_cached_t *o;
+    hqr_shard_t *s;
+    int i;
+
+    if ((hqr == NULL) || (hqr->cache == NULL))
+	return;
+
+    for (i = 0; i < HQR_CACHE_SHARDS; i++) {
+	s = &hqr->cache->shards[i];
+
+	pthread_mutex_lock(&s->mutex);
+	while (s->head != NULL) {
+		o = s->head;
+		hqr_shard_unlink(s, o);
+		if (o->refs == 0)
+			free(o);
+	}
+	pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+
+/* Sums up the cache hits, misses and the bytes it holds. */
+void
+hqr_cache_stats(hqr_t *hqr, int64_t *hits, int64_t *misses, int64_t *bytes)
+{
+    hqr_shard_t *s;
+    int64_t h = 0, m = 0, b = 0;
+    int i;
+
+    for (i = 0; (hqr != NULL) && (hqr->cache != NULL) && (i < HQR_CACHE_SHARDS); i++) {
+	s = &hqr->cache->shards[i];
+
+	pthread_mutex_lock(&s->mutex);
+	h += s->hits;
+	m += s->misses;
+	b += s->bytes;
+	pthread_mutex_unlock(&s->mutex);
+    }
+
+    if (hits != NULL)
+	*hits = h;
+    if (misses != NULL)
+	*misses = m;
+    if (bytes != NULL)
+	*bytes = b;
+}
+
+
+static void
+hqr_cache_free(hqr_t *hqr)
+{
+    int i;
+
+    if (hqr->cache == NULL)
+	return;
+
+    hqr_cache_flush(hqr);
+
+    for (i = 0; i < HQR_CACHE_SHARDS; i++) {
+	pthread_mutex_destroy(&hqr->cache->shards[i].mutex);
+	free(hqr->cache->shards[i].table);
+    }
+    pthread_mutex_destroy(&hqr->cache->file_mutex);
+
+    free(hqr->cache);
+    hqr->cache = NULL;
+}
+
+
+int32_t
+hqr_entry_delete(hqr_t *hqr, int32_t entry, int32_t delete_children)
+{
+    int32_t i, delete, list_entry_del = 0, first_ptr = UNUSED;
+    int32_t k;
+
+    if (hqr == NULL)
+	return 0;
+
+    if ((entry < 0) || (entry >= hqr->entries_no))
+	return 0;
+
+    if (hqr->entries[entry].entry_type == ENTRY_EOF)
+	return 0;
+
+    hqr->heap = 1;
+    hqr_cache_flush(hqr);
+
+    delete = (hqr->entries[entry].children_no == 0) || delete_children;
+
+    /* Pass 1: Find all entries that point to us. */
+    if (hqr->entries[entry].entry_type == ENTRY_NORMAL) {
+	/* There are no pointers to pointers or pointers to NULL entries. */
+	for (i = 0; i < hqr->entries_no; i++) {
+		if (hqr->entries[i].parent == entry) {
+			first_ptr = i;
+			break;
+   		}
+	}
+    }
+
+    if (first_ptr != UNUSED) {
+	/* If anything points to us, then do not delete the data field or children, but pass them to the
+	   pointer. */
+	for (i = first_ptr + 1; i < hqr->entries_no; i++) {
+		if (hqr->entries[i].parent == entry)
+			hqr->entries[i].parent = first_ptr;
+	}
+
+	hqr->entries[first_ptr].entry_type = ENTRY_NORMAL;
+	hqr->entries[first_ptr].parent = UNUSED;
+	hqr->entries[first_ptr].dec_size = hqr->entries[entry].dec_size;
+	hqr->entries[first_ptr].comp_size = hqr->entries[entry].comp_size;
+	hqr->entries[first_ptr].comp_type = hqr->entries[entry].comp_type;
+	hqr->entries[first_ptr].tbl_next_off = hqr->entries[entry].tbl_next_off;
+	hqr->entries[first_ptr].size_next_off = hqr->entries[entry].size_next_off;
+	hqr->entries[first_ptr].data = hqr->entries[entry].data;
+	hqr->entries[first_ptr].dec = hqr->entries[entry].dec;
+	hqr->entries[first_ptr].children_no = hqr->entries[entry].children_no;
+	hqr->entries[first_ptr].children = hqr->entries[entry].children;
+
+	/* Clean up our own entry. */
+	hqr->entries[entry].data = NULL;
+	hqr->entries[entry].dec = NULL;
+	hqr->entries[entry].children_no = 0;
+	hqr->entries[entry].children = NULL;
+	/* Force no deletion of children if we're passing ourselves to our first pointer. */
+	delete = 0;
+
+	/* The pointer has the same offset, so it takes our place in the index. */
+	k = hqr_find_entry_offset(hqr, entry);
+	if (k != UNUSED)
+		hqr->offsets[k].entry = first_ptr;
+    }
+
+    /* Finish removing ourselves, with the decompressed data first - a
+       pointer only borrows it from its parent, so the pointers to us lose
+       it too. */
+    if ((hqr->entries[entry].entry_type != ENTRY_POINTER) && (hqr->entries[entry].dec != NULL)) {
+	hqr_dec_free((hqr_common_t *) &hqr->entries[entry]);
+	for (i = 0; i < hqr->entries_no; i++) {
+		if ((hqr->entries[i].entry_type == ENTRY_POINTER) && (hqr->entries[i].parent == entry))
+			hqr->entries[i].dec = NULL;
+	}
+    }
+    hqr->entries[entry].dec = NULL;
+
+    /* Next, the data field. */
+    if (hqr->entries[entry].data != NULL) {
+	hqr_data_free(hqr, hqr->entries[entry].data);
+	hqr->entries[entry].data = NULL;
+    }
+
+    /* Next, the description field. */
+    if (hqr->entries[entry].desc != NULL) {
+	hqr_data_free(hqr, hqr->entries[entry].desc);
+	hqr->entries[entry].desc = NULL;
+    }
+
+    if ((hqr->entries[entry].children_no == 0) || delete) {
+	/* Update all parents - do this here so that if we pass ourselves to our
+	   first child, we do not update parents as our entry is still going to
+	   exist. */
+	for (i = 0; i < hqr->entries_no; i++) {
+		if (hqr->entries[i].parent > entry)
+			hqr->entries[i].parent--;
+	}
+	list_entry_del = 1;
+
+	/* Same for the offset index, where our offset is gone with us. */
+	k = hqr_find_entry_offset(hqr, entry);
+	if (k != UNUSED)
+		hqr_offsets_remove(hqr, k);
+	hqr_offsets_shift(hqr, entry + 1, -1);
+    }
+
+    if (hqr->entries[entry].children_no != 0) {
+	/* And now the children. */
+	if (delete) {
+		/* Delete all of them. */
+		for (i = 0; i < hqr->entries[entry].children_no; i++) {
+			hqr_dec_free(&hqr->entries[entry].children[i]);
+
+			/* Data field. */
+			if (hqr->entries[entry].children[i].data != NULL) {
+				hqr_data_free(hqr, hqr->entries[entry].children[i].data);
+				hqr->entries[entry].children[i].data = NULL;
+			}
+
+			/* Next, the description field. */
+			if (hqr->entries[entry].children[i].desc != NULL) {
+				hqr_data_free(hqr, hqr->entries[entry].children[i].desc);
+				hqr->entries[entry].children[i].desc = NULL;
+			}
+		}
+
+		hqr_data_free(hqr, (uint8_t *) hqr->entries[entry].children);
+		hqr->entries[entry].children_no = 0;
+		hqr->entries[entry].children = NULL;
+	} else {
+		/* Pass ourselves to our first child. */
+		hqr->entries[entry].dec_size = hqr->entries[entry].children[0].dec_size;
+		hqr->entries[entry].comp_size = hqr->entries[entry].children[0].comp_size;
+		hqr->entries[entry].comp_type = hqr->entries[entry].children[0].comp_type;
+		hqr->entries[entry].desc = hqr->entries[entry].children[0].desc;
+		hqr->entries[entry].data = hqr->entries[entry].children[0].data;
+		hqr->entries[entry].dec = hqr->entries[entry].children[0].dec;
+		hqr->entries[entry].offset = hqr->entries[entry].children[0].offset;
+		hqr->entries[entry].size_next_off = hqr->entries[entry].children[0].size_next_off;
+
+		/* The first child comes before the next entry in the file, so
+		   the index stays sorted, unless the child was not loaded from
+		   it and has no offset. */
+		k = hqr_find_entry_offset(hqr, entry);
+		if ((k != UNUSED) && (hqr->entries[entry].offset != 0))
+			hqr->offsets[k].offset = hqr->entries[entry].offset;
+		else if (k != UNUSED)
+			hqr_offsets_remove(hqr, k);
+
+		/* Remove the first child from the list. */
+		for (i = 1; i < hqr->entries[entry].children_no; i++)
+			hqr->entries[entry].children[i - 1] = hqr->entries[entry].children[i];
+		memset(&hqr->entries[entry].children[hqr->entries[entry].children_no - 1], 0x00, sizeof(hqr_common_t));
+		hqr->entries[entry].children = hqr_children_resize(hqr, &hqr->entries[entry],
+								   hqr->entries[entry].children_no - 1);
+		hqr->entries[entry].children_no--;
+	}
+    }
+
+    if (list_entry_del) {
+	/* Remove ourselves from the list. */
+	for (i = entry + 1; i < hqr->entries_no; i++)
+		hqr->entries[i - 1] = hqr->entries[i];
+	hqr->entries_no--;
+	memset(&hqr->entries[hqr->entries_no], 0x00, sizeof(hqr_entry_t));
+	if (hqr->entries_no == 0) {
+		free(hqr->entries);
+		hqr->entries = NULL;
+		hqr->entries_size = 0;
+	}
+    }
+
+    return 1;
+}
+
+
+/* Returns one of the HQR_PROFILE_* presets, or the balanced one if the
+   preset does not exist. */
+hqr_profile_t
+hqr_profile_preset(int profile)
+{
+    if ((profile < HQR_PROFILE_BALANCED) || (profile > HQR_PROFILE_FAST_DISK_SLOW_CPU))
+	profile = HQR_PROFILE_BALANCED;
+
+    return hqr_profiles[profile];
+}
+
+
+/* Compresses dec_size bytes of buf into a buffer of the same size for a
+   new entry, with the pre-scan on. Returns the compressed size, or -1 if
+   the data does not get any smaller. */
+static int32_t
+hqr_compress(int16_t comp_type, uint8_t *data, char *buf, int32_t dec_size)
+{
+    comp_ctx_t *ctx;
+    int32_t ret;
+
+    ctx = comp_ctx_new();
+    if (ctx == NULL)
+	return -1;
+
+    comp_ctx_set_scan(ctx, HQR_SCAN_THRESHOLD);
+    ret = compress_safe_ctx(ctx, comp_type, (char *) data, dec_size, buf, dec_size);
+
+    comp_ctx_free(ctx);
+
+    return ret;
+}
+
+
+/* Compresses the entry with one LZ type and counts the literals and
+   matches of the result. Leaves data at NULL if the type does not make
+   the entry any smaller. */
+static void *
+hqr_candidate_eval(void *priv)
+{
+    hqr_candidate_t *c = (hqr_candidate_t *) priv;
+    int32_t pos = 0;
+    int bit;
+
+    c->data = (uint8_t *) malloc(c->dec_size);
+    if (c->data == NULL)
+	c->comp_size = -1;
+    else
+	c->comp_size = hqr_compress(c->comp_type, c->data, c->buf, c->dec_size);
+
+    if (c->comp_size < 0) {
+	free(c->data);
+	c->data = NULL;
+	return NULL;
+    }
+
+    /* Each flag byte covers 8 tokens: a set bit is a 1 byte literal, a
+       clear one a 2 bytes match. */
+    c->literals = c->matches = 0;
+    while (pos < c->comp_size) {
+	uint8_t flags = c->data[pos++];
+
+	for (bit = 0; (bit < 8) && (pos < c->comp_size); bit++, flags >>= 1) {
+		if (flags & 1) {
+			c->literals++;
+			pos++;
+		} else {
+			c->matches++;
+			pos += 2;
+		}
+	}
+    }
+
+    return NULL;
+}
+
+
+/* Load cost of an entry under a profile, in seconds: reading the compressed
+   bytes, plus decoding them on the target CPU. The decode time is modelled
+   from the token counts rather than measured, so that the same entry always
+   gets the same type. */
+static double
+hqr_candidate_cost(const hqr_profile_t *profile, int32_t comp_size, int32_t literals, int32_t matches)
+{
+    double dec_time = ((double) literals * AUTO_LITERAL_TIME) + ((double) matches * AUTO_MATCH_TIME);
+
+    return ((double) comp_size / (profile->read_mbs * 1048576.0)) + (dec_time * profile->cpu_scale);
+}
+
+
+/* HQR_COMPRESS_AUTO: makes the LZSS and LZMIT candidates, the second one on
+   another thread for big entries, and keeps whichever of them or Store is
+   the cheapest to load. Store costs nothing to decode. On equal costs, the
+   smaller result wins, then the lower type. */
+static void
+hqr_entry_auto(hqr_common_t *hc, const hqr_profile_t *profile, char *buf)
+{
+    hqr_candidate_t c[2];
+    pthread_t thread;
+    double cost, best_cost;
+    int32_t best_size;
+    uint8_t *data;
+    int i, best = -1, threaded = 0;
+
+    for (i = 0; i < 2; i++) {
+	memset(&c[i], 0x00, sizeof(hqr_candidate_t));
+	c[i].comp_type = COMPRESS_LZSS + i;
+	c[i].dec_size = hc->dec_size;
+	c[i].buf = buf;
+    }
+
+    if (hc->dec_size >= AUTO_THREAD_MIN)
+	threaded = (pthread_create(&thread, NULL, hqr_candidate_eval, &c[1]) == 0);
+
+    hqr_candidate_eval(&c[0]);
+
+    if (threaded)
+	pthread_join(thread, NULL);
+    else
+	hqr_candidate_eval(&c[1]);
+
+    best_cost = hqr_candidate_cost(profile, hc->dec_size, 0, 0);
+    best_size = hc->dec_size;
+    for (i = 0; i < 2; i++) {
+	if (c[i].data == NULL)
+		continue;
+
+	cost = hqr_candidate_cost(profile, c[i].comp_size, c[i].literals, c[i].matches);
+	if ((cost < best_cost) || ((cost == best_cost) && (c[i].comp_size < best_size))) {
+		best_cost = cost;
+		best_size = c[i].comp_size;
+		best = i;
+	}
+    }
+
+    for (i = 0; i < 2; i++) {
+	if ((i != best) && (c[i].data != NULL))
+		free(c[i].data);
+    }
+
+    if (best == -1) {
+	hc->comp_type = COMPRESS_STORE;
+	hc->data = (uint8_t *) malloc(hc->dec_size);
+	hc->comp_size = compress_store((char *) hc->data, buf, hc->dec_size);
+    } else {
+	hc->comp_type = c[best].comp_type;
+	hc->comp_size = c[best].comp_size;
+	data = (uint8_t *) realloc(c[best].data, c[best].comp_size);
+	hc->data = (data != NULL) ? data : c[best].data;
+    }
+}
+
+
+/* Like hqr_entry_new(), with the load profile HQR_COMPRESS_AUTO optimizes
+   for, or the balanced one if profile is NULL. */
+hqr_common_t
+hqr_entry_new_profile(int32_t entry_type, int32_t parent, int32_t dec_size, int16_t comp_type,
+		      const hqr_profile_t *profile, char *buf)
+{
+    hqr_common_t hc;
+    uint8_t *data;
+
+    memset(&hc, 0x00, sizeof(hqr_common_t));
+
+    hc.entry_type = entry_type;
+    hc.parent = parent;
+    hc.dec_size = dec_size;
+
+    if (comp_type == HQR_COMPRESS_AUTO) {
+	if ((profile == NULL) || (profile->read_mbs <= 0.0) || (profile->cpu_scale <= 0.0))
+		profile = &hqr_profiles[HQR_PROFILE_BALANCED];
+	hqr_entry_auto(&hc, profile, buf);
+	return hc;
+    }
+
+    /* Force Store if someone tries an invalid type. */
+    if ((comp_type < COMPRESS_STORE) || (comp_type > COMPRESS_LZMIT))
+	comp_type = COMPRESS_STORE;
+
+    /* Data that does not get smaller is stored instead, so a buffer of the
+       decompressed size is always enough; it is trimmed to fit after. */
+    hc.data = (uint8_t *) malloc(dec_size);
+    hc.comp_size = hqr_compress(comp_type, hc.data, buf, dec_size);
+    if (hc.comp_size < 0) {
+	comp_type = COMPRESS_STORE;
+	hc.comp_size = compress_store((char *) hc.data, buf, dec_size);
+    } else if ((hc.comp_size > 0) && (hc.comp_size < dec_size)) {
+	data = (uint8_t *) realloc(hc.data, hc.comp_size);
+	if (data != NULL)
+		hc.data = data;
+    }
+    hc.comp_type = comp_type;
+
+    return hc;
+}
+
+
+hqr_common_t
+hqr_entry_new(int32_t entry_type, int32_t parent, int32_t dec_size, int16_t comp_type, char *buf)
+{
+    return hqr_entry_new_profile(entry_type, parent, dec_size, comp_type, NULL, buf);
+}
+
+
+/* Replaces the data of a normal entry, or with child not -1, of one of
+   its children, by that of hc as made by hqr_entry_new(), which the
+   archive takes over. The pointers to the entry share the new data. The
+   old place in the file is given up, so hqr_update() writes it again. */
+int32_t
+hqr_entry_replace(hqr_t *hqr, int32_t entry, int32_t child, hqr_common_t hc)
+{
+    hqr_common_t *dst;
+    int32_t i;
+
+    if ((hqr == NULL) || (entry < 0) || (entry >= hqr->entries_no))
+	return 0;
+
+    if (hqr->entries[entry].entry_type != ENTRY_NORMAL)
+	return 0;
+
+    if ((child < UNUSED) || (child >= hqr->entries[entry].children_no))
+	return 0;
+
+    if ((hc.data == NULL) && (hc.comp_size > 0))
+	return 0;
+
+    hqr->heap = 1;
+    hqr_cache_flush(hqr);
+
+    if (child == UNUSED) {
+	/* hqr_common_t has the same layout as hqr_entry_t. */
+	dst = (hqr_common_t *) &hqr->entries[entry];
+
+	/* The pointers only borrow the decompressed data. */
 	for (i = 0; i < hqr->entries_no; i++) {
-		if (hqr->entries[i].parent > entry)
-			hqr->entries[i].parent--;
+		if ((hqr->entries[i].entry_type == ENTRY_POINTER) && (hqr->entries[i].parent == entry))
+			hqr->entries[i].dec = NULL;
+	}
+    } else
+	dst = &hqr->entries[entry].children[child];
+
+    hqr_dec_free(dst);
+    hqr_data_free(hqr, dst->data);
+
+    dst->dec_size = hc.dec_size;
+    dst->comp_size = hc.comp_size;
+    dst->comp_type = hc.comp_type;
+    dst->data = hc.data;
+    dst->offset = dst->size_next_off = 0x00000000;
+
+    return 1;
+}
+
+
+/* Add a HQR entry:
+	- After a child:
+		- Before a child - always add as a child;
+		- Before a normal entry - add as a normal entry or child depending on the parameter;
+		- Before anything else - always add as a normal entry;
+	- After a normal entry:
+		- Before a child - add as a normal entry or child depending on the parameter;
+		- Before another normal entry - add as a normal entry or child depending on the parameter;
+		- Before anything else - always add as a normal entry;
+	- After anything else:
+		- Before a child - this is an invalid situation that can not exist;
+		- Before another normal entry - always add as a normal entry;
+		- Before anything else - always add as a normal entry. */
+int32_t
+hqr_entry_insert(hqr_t *hqr, int32_t entry, int32_t child, hqr_common_t hc, int32_t add_as_child)
+{
+    int32_t prev_entry_type = ENTRY_UNUSED, next_entry_type = ENTRY_UNUSED;
+    int32_t i;
+    hqr_common_t *children;
+
+    /* Uninitialized High Quality Resource, do nothing. */
+    if (hqr == NULL)
+	return 0;
+
+    /* Attempting to insert an invalid or EOF type, do nothing. */
+    if ((hc.entry_type < ENTRY_NULL) || (hc.entry_type >= ENTRY_EOF))
+	return 0;
+
+    /* Return without doing anything if the entry number to insert at is invalid. */
+    if ((entry < 0) || (entry > hqr->entries_no))
+	return 0;
+
+    /* Return without doing anything if we're trying to add a child to a non-existent entry. */
+    if ((child != 0) && (entry == hqr->entries_no))
+	return 0;
+
+    /* Return without doing anything if the child number to insert at is invalid. */
+    if ((child < 0) || ((entry < hqr->entries_no) && (child > hqr->entries[entry].children_no)))
+	return 0;
+
+    if ((child == 0) && (entry > 0))
+	prev_entry_type = hqr->entries[entry - 1].entry_type;
+    else if (child > 0)
+	prev_entry_type = ENTRY_CHILD;
+
+    /* Appending comes before the end of the file. */
+    if (entry == hqr->entries_no)
+	next_entry_type = ENTRY_EOF;
+    else if ((child == hqr->entries[entry].children_no) && (entry < (hqr->entries_no - 1)))
+	next_entry_type = hqr->entries[entry].entry_type;
+    else if (child < hqr->entries[entry].children_no)
+	next_entry_type = ENTRY_CHILD;
+
+    /* Uninitialized High Quality Resource, do nothing. */
+    if ((prev_entry_type == ENTRY_UNUSED) && (next_entry_type == ENTRY_UNUSED))
+	return 0;
+
+    /* Attempting to insert an entry after the EOF entry, do nothing. */
+    if (prev_entry_type == ENTRY_EOF)
+	return 0;
+
+    /* Impossible combination, get out. */
+    if ((prev_entry_type != ENTRY_NORMAL) && (next_entry_type == ENTRY_CHILD))
+	return 0;
+
+    /* If the next entry is not normal, always insert it as a normal entry. */
+    if ((next_entry_type != ENTRY_NORMAL) && (next_entry_type != ENTRY_EOF))
+	add_as_child = 0;
+
+    /* If we're after an entry that's not normal, and before an entry that's
+       either normal or EOF, always insert it as a normal entry. */
+    if ((prev_entry_type != ENTRY_NORMAL) && ((next_entry_type == ENTRY_NORMAL) || (next_entry_type == ENTRY_EOF)))
+	add_as_child = 0;
+
+    /* If we're between children, always insert it as a child. */
+    if ((prev_entry_type == ENTRY_CHILD) && (next_entry_type == ENTRY_CHILD))
+	add_as_child = 1;
+
+    if (add_as_child) {
+	/* Attempting to insert a pointer or null entry as a child, do nothing. */
+	if (hc.entry_type != ENTRY_NORMAL)
+		return 0;
+    }
+
+    hqr->heap = 1;
+    hqr_cache_flush(hqr);
+
+    if (add_as_child) {
+	children = hqr_children_resize(hqr, &hqr->entries[entry], hqr->entries[entry].children_no + 1);
+	if (children == NULL)
+		return 0;
+	hqr->entries[entry].children = children;
+
+	if (child < hqr->entries[entry].children_no) {
+		for (i = hqr->entries[entry].children_no; i > child; i--)
+			hqr->entries[entry].children[i] = hqr->entries[entry].children[i - 1];
+	}
+
+	hqr->entries[entry].children[child] = hc;
+	hqr->entries[entry].children_no++;
+    } else {
+	if (!hqr_grow((void **) &hqr->entries, &hqr->entries_size, hqr->entries_no + 1, sizeof(hqr_entry_t)))
+		return 0;
+
+	/* Update parents. */
+	for (i = 0; i < hqr->entries_no; i++) {
+		 if (hqr->entries[i].parent >= entry)
+			hqr->entries[i].parent++;
+	}
+	hqr_offsets_shift(hqr, entry, 1);
+
+	if (entry < hqr->entries_no) {
+		for (i = hqr->entries_no; i > entry; i--)
+			hqr->entries[i] = hqr->entries[i - 1];
+	}
+
+	/* hqr_common_t has the same layout as hqr_entry_t. */
+	memcpy(&hqr->entries[entry], &hc, sizeof(hqr_entry_t));
+	hqr->entries_no++;
+    }
+
+    return 1;
+}
+
+
+static void
+hqr_writer_flush(hqr_writer_t *w)
+{
+    if ((w->len > 0) && (fwrite(w->buf, 1, w->len, w->file) != (size_t) w->len))
+	w->failed = 1;
+
+    w->len = 0;
+}
+
+
+static void
+hqr_writer_put(hqr_writer_t *w, const void *data, int32_t len)
+{
+    if (len > (HQR_WRITE_SIZE - w->len))
+	hqr_writer_flush(w);
+
+    if (len > HQR_WRITE_SIZE) {
+	if (fwrite(data, 1, len, w->file) != (size_t) len)
+		w->failed = 1;
+	return;
+    }
+
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+
+static void
+hqr_writer_put32(hqr_writer_t *w, int32_t val)
+{
+    uint8_t b[4];
+
+    b[0] = val & 0xff;
+    b[1] = (val >> 8) & 0xff;
+    b[2] = (val >> 16) & 0xff;
+    b[3] = (val >> 24) & 0xff;
+
+    hqr_writer_put(w, b, 4);
+}
+
+
+/* Writes the header and the data of an entry or child. Data that an
+   index-only load left in the source file is copied from it through the
+   write buffer. */
+static void
+hqr_writer_entry(hqr_writer_t *w, hqr_t *hqr, hqr_common_t *hc)
+{
+    uint8_t hdr[10];
+    int32_t i, n;
+
+    for (i = 0; i < 4; i++) {
+	hdr[i] = (hc->dec_size >> (i << 3)) & 0xff;
+	hdr[4 + i] = (hc->comp_size >> (i << 3)) & 0xff;
+    }
+    hdr[8] = hc->comp_type & 0xff;
+    hdr[9] = (hc->comp_type >> 8) & 0xff;
+
+    hqr_writer_put(w, hdr, 10);
+
+    if (hc->data != NULL) {
+	hqr_writer_put(w, hc->data, hc->comp_size);
+	return;
+    }
+
+    for (i = 0; (i < hc->comp_size) && !w->failed; i += n) {
+	if (w->len == HQR_WRITE_SIZE)
+		hqr_writer_flush(w);
+
+	n = HQR_WRITE_SIZE - w->len;
+	if (n > (hc->comp_size - i))
+		n = hc->comp_size - i;
+
+	if (!hqr_read(hqr, hc->offset + 10 + i, w->buf + w->len, n))
+		w->failed = 1;
+	w->len += n;
+    }
+}
+
+
+/* 64-bit hash of a buffer, 8 bytes at a time. Only used in memory, so it
+   does not matter that it differs between little and big endian hosts. */
+static uint64_t
+hqr_hash64(const uint8_t *p, int32_t len, uint64_t h)
+{
+    uint64_t v;
+
+    h ^= (uint64_t) len * 0x9e3779b97f4a7c15ULL;
+
+    for (; len >= 8; len -= 8, p += 8) {
+	memcpy(&v, p, 8);
+	v *= 0x87c37b91114253d5ULL;
+	v = (v << 31) | (v >> 33);
+	h ^= v * 0x4cf5ad432745937fULL;
+	h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+
+    for (; len > 0; len--, p++)
+	h = (h ^ *p) * 0x100000001b3ULL;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+
+static int
+hqr_compare_dups(const void *a, const void *b)
+{
+    const hqr_dup_t *x = (const hqr_dup_t *) a, *y = (const hqr_dup_t *) b;
+
+    if (x->hash != y->hash)
+	return (x->hash > y->hash) ? 1 : -1;
+
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+
+/* Frees what hqr_save_dec() decoded into copy. */
+static void
+hqr_save_dec_free(hqr_common_t *hc, hqr_common_t *copy)
+{
+    if (hc->dec != NULL)
+	return;
+
+    hqr_dec_free(copy);
+    if (copy->data != hc->data)
+	free(copy->data);
+}
+
+
+/* Decompressed data of an entry or child: its dec field if it has one,
+   or else decoded into copy, which is a copy of the entry or child so
+   that the archive is left as it is. hqr_save_dec_free() frees it. */
+static uint8_t *
+hqr_save_dec(hqr_t *hqr, hqr_common_t *hc, hqr_common_t *copy)
+{
+    *copy = *hc;
+
+    if (hc->dec != NULL)
+	return hc->dec;
+
+    if (!hqr_entry_decode(hqr, copy)) {
+	hqr_save_dec_free(hc, copy);
+	return NULL;
+    }
+
+    return copy->dec;
+}
+
+
+/* Hash of the decompressed data of an entry and of its children, which a
+   pointer shares along with the data. Returns 0 if it does not decode. */
+static int32_t
+hqr_save_hash(hqr_t *hqr, int32_t entry, uint64_t *hash)
+{
+    hqr_entry_t *he = &hqr->entries[entry];
+    hqr_common_t *hc, copy;
+    uint8_t *dec;
+    uint64_t h = 0;
+    int32_t j;
+
+    for (j = UNUSED; j < he->children_no; j++) {
+	hc = (j == UNUSED) ? (hqr_common_t *) he : &he->children[j];
+
+	dec = hqr_save_dec(hqr, hc, &copy);
+	if (dec == NULL)
+		return 0;
+	h = hqr_hash64(dec, hc->dec_size, h);
+	hqr_save_dec_free(hc, &copy);
+    }
+
+    *hash = h;
+
+    return 1;
+}
+
+
+/* Byte compare of the decompressed data of two entries and their
+   children. */
+static int32_t
+hqr_save_same(hqr_t *hqr, int32_t a, int32_t b)
+{
+    hqr_entry_t *ea = &hqr->entries[a], *eb = &hqr->entries[b];
+    hqr_common_t *ha, *hb, ca, cb;
+    uint8_t *da, *db;
+    int32_t j, same = 1;
+
+    if ((ea->dec_size != eb->dec_size) || (ea->children_no != eb->children_no))
+	return 0;
+
+    for (j = UNUSED; same && (j < ea->children_no); j++) {
+	ha = (j == UNUSED) ? (hqr_common_t *) ea : &ea->children[j];
+	hb = (j == UNUSED) ? (hqr_common_t *) eb : &eb->children[j];
+	if (ha->dec_size != hb->dec_size)
+		return 0;
+
+	da = hqr_save_dec(hqr, ha, &ca);
+	db = hqr_save_dec(hqr, hb, &cb);
+	same = (da != NULL) && (db != NULL) && !memcmp(da, db, ha->dec_size);
+	if (da != NULL)
+		hqr_save_dec_free(ha, &ca);
+	if (db != NULL)
+		hqr_save_dec_free(hb, &cb);
+    }
+
+    return same;
+}
+
+
+/* Finds the normal entries of the archive that decompress to the same
+   bytes, children included, as an earlier one, which hqr_save() then
+   writes as pointers to it. Only entries with the same sizes as another
+   one are decoded and hashed, and matching hashes are confirmed with a
+   byte compare. Returns an array with, for every entry, the entry it
+   duplicates or UNUSED, or NULL if there is nothing to share. */
+static int32_t *
+hqr_save_dups(hqr_t *hqr)
+{
+    hqr_entry_t *he;
+    hqr_dup_t *d;
+    int32_t *dup = NULL;
+    int32_t i, j, k, n = 0, m;
+    uint64_t h;
+
+    d = (hqr_dup_t *) malloc((hqr->entries_no + 1) * sizeof(hqr_dup_t));
+    if (d == NULL)
+	return NULL;
+
+    /* Pass 1: the sizes of every normal entry and of its children. */
+    for (i = 0; i < hqr->entries_no; i++) {
+	he = &hqr->entries[i];
+	if (he->entry_type != ENTRY_NORMAL)
+		continue;
+
+	h = hqr_hash64((uint8_t *) &he->dec_size, 4, he->children_no);
+	for (j = 0; j < he->children_no; j++)
+		h = hqr_hash64((uint8_t *) &he->children[j].dec_size, 4, h);
+
+	d[n].hash = h;
+	d[n].entry = i;
+	n++;
+    }
+
+    qsort(d, n, sizeof(hqr_dup_t), hqr_compare_dups);
+
+    /* Pass 2: hash the content of the entries that share their sizes with
+       another one, and drop the others. */
+    for (i = m = 0; i < n; i = j) {
+	for (j = i + 1; (j < n) && (d[j].hash == d[i].hash); j++)
+		;
+	if ((j - i) < 2)
+		continue;
+
+	for (k = i; k < j; k++) {
+		if (hqr_save_hash(hqr, d[k].entry, &h)) {
+			d[m].hash = h;
+			d[m].entry = d[k].entry;
+			m++;
+		}
 	}
-	list_entry_del = 1;
     }
 
-    if (hqr->entries[entry].children_no != 0) {
-	/* And now the children. */
-	if (delete) {
-		/* Delete all of them. */
-		for (i = 0; i < hqr->entries[entry].children_no; i++) {
-			/* Data field. */
-			if (hqr->entries[entry].children[i].data != NULL) {
-				free(hqr->entries[entry].children[i].data);
-				hqr->entries[entry].children[i].data = NULL;
-			}
+    qsort(d, m, sizeof(hqr_dup_t), hqr_compare_dups);
 
-			/* Next, the description field. */
-			if (hqr->entries[entry].children[i].desc != NULL) {
-				free(hqr->entries[entry].children[i].desc);
-				hqr->entries[entry].children[i].desc = NULL;
-			}
-		}
+    /* Pass 3: within a run of equal hashes, sorted by entry, whatever is
+       the same as the first one points to it. */
+    for (i = 0; i < m; i = j) {
+	for (j = i + 1; (j < m) && (d[j].hash == d[i].hash); j++) {
+		if (!hqr_save_same(hqr, d[i].entry, d[j].entry))
+			continue;
 
-		hqr->entries[entry].children_no = 0;
-		free(hqr->entries[entry].children);
-		hqr->entries[entry].children = NULL;
-	} else {
-		/* Pass ourselves to our first child. */
-		hqr->entries[entry].dec_size = hqr->entries[entry].children[0].dec_size;
-		hqr->entries[entry].comp_size = hqr->entries[entry].children[0].comp_size;
-		hqr->entries[entry].comp_type = hqr->entries[entry].children[0].comp_type;
-		hqr->entries[entry].desc = hqr->entries[entry].children[0].desc;
-		hqr->entries[entry].data = hqr->entries[entry].children[0].data;
+		if (dup == NULL) {
+			dup = (int32_t *) malloc(hqr->entries_no * sizeof(int32_t));
+			if (dup == NULL)
+				break;
+			for (k = 0; k < hqr->entries_no; k++)
+				dup[k] = UNUSED;
+		}
 
-		/* Remove the first child from the list. */
-		for (i = 1; i < hqr->entries[entry].children_no; i++)
-			hqr->entries[entry].children[i - 1] = hqr->entries[entry].children[i];
-		hqr->entries[entry].children_no--;
-		memset(hqr->entries[entry].children[hqr->entries[entry].children_no], 0x00, sizeof(hqr_common_t));
-		if (hqr->entries[entry].children_no == 0) {
-			free(hqr->entries[entry].children);
-			hqr->entries[entry].children = NULL;
-		} else
-			hqr->entries[entry].children = (hqr_common_t *) realloc(hqr->entries[entry].children,
-									hqr->entries[entry].children_no * sizeof(hqr_common_t));
+		dup[d[j].entry] = d[i].entry;
 	}
     }
 
-    if (list_entry_del) {
-	/* Remove ourselves from the list. */
-	for (i = entry + 1; i < hqr_entries_no; i++)
-		hqr->entries[i - 1] = hqr->entries[i];
-	hqr->entries_no--;
-	memset(hqr->entries[hqr->entries_no], 0x00, sizeof(hqr_entry_t));
-	if (hqr->entries_no == 0) {
-		free(hqr->entries);
-		hqr->entries = NULL;
-	} else
-		hqr->entries = (hqr_entry_t *) realloc(hqr->entries, hqr->entries_no * sizeof(hqr_entry_t));
-    }
+    free(d);
 
-    return 1;
+    return dup;
 }
 
 
-hqr_common_t
-hqr_entry_new(int32_t entry_type, int32_t parent, int32_t dec_size, int16_t comp_type, char *buf)
+/* Offsets of the entries in the archive hqr_save() writes: the table,
+   then every normal entry in table order, each followed by its children.
+   NULL entries are 0, pointers get the offset of their entry, and the
+   last one is the end of the file. With dup not NULL, the entries it
+   maps to an earlier one are written as pointers to it (see
+   hqr_save_dups()). Returns NULL if the archive can not be written. */
+static int32_t *
+hqr_save_offsets(hqr_t *hqr, int32_t *dup)
 {
-    hqr_common_t hc;
+    hqr_entry_t *he;
+    int32_t *offsets;
+    int64_t offset = ((int64_t) hqr->entries_no + 1) << 2;
+    int32_t i, j, p;
 
-    memset(&hc, 0x00, sizeof(hqr_common_t));
+    offsets = (int32_t *) malloc((hqr->entries_no + 1) * sizeof(int32_t));
+    if (offsets == NULL)
+	return NULL;
 
-    hc.entry_type = entry_type;
-    hc.parent = parent;
-    hc.dec_size = dec_size;
+    for (i = 0; i < hqr->entries_no; i++) {
+	he = &hqr->entries[i];
+	offsets[i] = 0x00000000;
 
-    /* Force Store if someone tries an invalid type. */
-    if ((comp_type < COMPRESS_STORE) || (comp_type < COMPRESS_LZMIT))
-	comp_type = 0;
-    hc.comp_type = comp_type;
+	if ((he->entry_type != ENTRY_NORMAL) || ((dup != NULL) && (dup[i] != UNUSED)))
+		continue;
 
-    hc.data = (char *) malloc(val << 1);
-    hc.comp_size = compress(comp_type, hc.data, buf, val);
+	/* Data that is not in memory has to be in the source file. */
+	if ((he->data == NULL) && (he->comp_size > 0) && (hqr->file == NULL))
+		goto fail;
 
-    return hc;
+	offsets[i] = (int32_t) offset;
+	offset += 10 + he->comp_size;
+
+	for (j = 0; j < he->children_no; j++) {
+		if ((he->children[j].data == NULL) && (he->children[j].comp_size > 0) && (hqr->file == NULL))
+			goto fail;
+		offset += 10 + he->children[j].comp_size;
+	}
+
+	if (offset > INT32_MAX)
+		goto fail;
+    }
+    offsets[hqr->entries_no] = (int32_t) offset;
+
+    for (i = 0; i < hqr->entries_no; i++) {
+	if (hqr->entries[i].entry_type == ENTRY_NORMAL) {
+		if ((dup != NULL) && (dup[i] != UNUSED))
+			offsets[i] = offsets[dup[i]];
+		continue;
+	}
+	if (hqr->entries[i].entry_type != ENTRY_POINTER)
+		continue;
+
+	p = hqr->entries[i].parent;
+	if ((p < 0) || (p >= hqr->entries_no) || (hqr->entries[p].entry_type != ENTRY_NORMAL))
+		goto fail;
+	if ((dup != NULL) && (dup[p] != UNUSED))
+		p = dup[p];
+	offsets[i] = offsets[p];
+    }
+
+    return offsets;
+
+fail:
+    free(offsets);
+
+    return NULL;
 }
 
 
-/* Add a HQR entry:
-	- After a child:
-		- Before a child - always add as a child;
-		- Before a normal entry - add as a normal entry or child depending on the parameter;
-		- Before anything else - always add as a normal entry;
-	- After a normal entry:
-		- Before a child - add as a normal entry or child depending on the parameter;
-		- Before another normal entry - add as a normal entry or child depending on the parameter;
-		- Before anything else - always add as a normal entry;
-	- After anything else:
-		- Before a child - this is an invalid situation that can not exist;
-		- Before another normal entry - always add as a normal entry;
-		- Before anything else - always add as a normal entry. */
+/* Writes the archive to path, in one sequential pass through a write
+   buffer. The compressed data of every entry is written as it is, so
+   nothing is compressed again, and entries that decompress to the same
+   bytes as an earlier one are written as pointers to it if dedup is
+   non-zero. After hqr_load_index() or
+   hqr_load_mmap(), path must not be the file being read from. Returns 1
+   on success, 0 on error. */
 int32_t
-hqr_entry_insert(hqr_t *hqr, int32_t entry, int32_t child, hqr_common_t hc, int32_t add_as_child, char *buf)
+hqr_save(hqr_t *hqr, char *path, int dedup)
 {
-    int32_t prev_entry_type = ENTRY_UNUSED, next_entry_type = ENTRY_UNUSED;
-    int32_t i;
+    hqr_writer_t w;
+    hqr_entry_t *he;
+    int32_t *offsets, *dup = NULL;
+    int32_t i, j;
 
-    /* Uninitialized High Quality Resource, do nothing. */
-    if (hqr_entries == NULL)
+    if ((hqr == NULL) || (path == NULL))
 	return 0;
 
-    /* Attempting to insert an invalid or EOF type, do nothing. */
-    if ((hc.entry_type < ENTRY_NULL) && (hc.entry_type >= ENTRY_EOF))
-	return 0;
+    if (dedup)
+	dup = hqr_save_dups(hqr);
 
-    /* Return without doing anything if the entry number to insert at is invalid. */
-    if ((entry < 0) || (entry > hqr->entries_no))
+    offsets = hqr_save_offsets(hqr, dup);
+    if (offsets == NULL) {
+	free(dup);
 	return 0;
+    }
 
-    /* Return without doing anything if we're trying to add a child to a non-existent entry. */
-    if ((child != 0) && (entry == hqr->entries_no))
+    memset(&w, 0x00, sizeof(hqr_writer_t));
+    w.buf = (uint8_t *) malloc(HQR_WRITE_SIZE);
+    w.file = fopen(path, "wb");
+    if ((w.buf == NULL) || (w.file == NULL)) {
+	if (w.file != NULL)
+		fclose(w.file);
+	free(w.buf);
+	free(offsets);
+	free(dup);
 	return 0;
+    }
 
-    /* Return without doing anything if the child number to insert at is invalid. */
-    if ((child < 0) || ((entry < hqr->entries_no) && (child > hqr->entries[entry].children_no)))
-	return 0;
+    for (i = 0; i <= hqr->entries_no; i++)
+	hqr_writer_put32(&w, offsets[i]);
 
-    if ((child == 0) && (entry > 0))
-	prev_entry_type = hqr_entries[entry - 1].entry_type;
-    else if (child > 0)
-	prev_entry_type = ENTRY_CHILD;
+    for (i = 0; (i < hqr->entries_no) && !w.failed; i++) {
+	he = &hqr->entries[i];
+	if ((he->entry_type != ENTRY_NORMAL) || ((dup != NULL) && (dup[i] != UNUSED)))
+		continue;
 
-    if ((child == hqr->entries[entry].children_no) && (entry < (hqr->entries_no - 1)))
-	next_entry_type = hqr->entries[entry].entry_type;
-    else if (child < hqr->entries[entry].children_no)
-	next_entry_type = ENTRY_CHILD;
+	/* hqr_common_t has the same layout as hqr_entry_t. */
+	hqr_writer_entry(&w, hqr, (hqr_common_t *) he);
+	for (j = 0; j < he->children_no; j++)
+		hqr_writer_entry(&w, hqr, &he->children[j]);
+    }
 
-    /* Uninitialized High Quality Resource, do nothing. */
-    if ((prev_entry_type == ENTRY_UNUSED) && (next_entry_type == ENTRY_UNUSED))
-	return 0;
+    hqr_writer_flush(&w);
+    if (fclose(w.file) != 0)
+	w.failed = 1;
 
-    /* Attempting to insert an entry after the EOF entry, do nothing. */
-    if (prev_entry_type == ENTRY_EOF)
-	return 0;
+    free(w.buf);
+    free(offsets);
+    free(dup);
 
-    /* Impossible combination, get out. */
-    if (prev_entry_type != ENTRY_NORMAL) && (next_entry_type == ENTRY_CHILD))
+    return !w.failed;
+}
+
+
+/* Whether an entry has to be written again by hqr_update(): it and its
+   children have to still be where they were read from, one after the
+   other, and end where its space in the file ends, which a deleted child
+   changes. Entries changed other than through this file must have their
+   offset set to 0 for this to see it. */
+static int32_t
+hqr_entry_changed(hqr_entry_t *he, int32_t table_end)
+{
+    hqr_common_t *hc;
+    int32_t j, end;
+
+    if ((he->offset < table_end) || (he->size_next_off != (he->offset + 10 + he->comp_size)))
+	return 1;
+
+    end = he->size_next_off;
+    for (j = 0; j < he->children_no; j++) {
+	hc = &he->children[j];
+	if ((hc->offset != end) || (hc->size_next_off != (end + 10 + hc->comp_size)))
+		return 1;
+	end = hc->size_next_off;
+    }
+
+    return (end != he->tbl_next_off);
+}
+
+
+/* Copies the data of an entry or child out of the mapping of
+   hqr_load_mmap() if it starts below end, where hqr_update() writes the
+   offset table and the first entry. */
+static int32_t
+hqr_data_keep(hqr_t *hqr, hqr_common_t *hc, int32_t end)
+{
+    uint8_t *data;
+
+    if ((hqr->map == NULL) || (hc->data < hqr->map) || (hc->data >= (hqr->map + end)))
+	return 1;
+
+    data = (uint8_t *) malloc(hc->comp_size + 1);
+    if (data == NULL)
 	return 0;
+    memcpy(data, hc->data, hc->comp_size);
 
-    /* If the next entry is not normal, always insert it as a normal entry. */
-    if ((next_entry_type != ENTRY_NORMAL) && (next_entry_type != ENTRY_EOF))
-	add_as_child = 0;
+    if (hc->dec == hc->data)
+	hc->dec = data;
+    hc->data = data;
+    hqr->heap = 1;
 
-    /* If we're after an entry that's not normal, and before an entry that's
-       either normal or EOF, always insert it as a normal entry. */
-    if ((prev_entry_type != ENTRY_NORMAL) && ((next_entry_type == ENTRY_NORMAL) || (next_entry_type == ENTRY_EOF)))
-	add_as_child = 0;
+    return 1;
+}
 
-    /* If we're between children, always insert it as a child. */
-    if ((prev_entry_type == ENTRY_CHILD) && (next_entry_type == ENTRY_CHILD))
-	add_as_child = 1;
 
-    if (add_as_child) {
-	/* Attempting to insert a pointer or null entry as a child, do nothing. */
-	if (hc.entry_type != ENTRY_NORMAL)
+/* Moves the writer of hqr_update() to offset. */
+static void
+hqr_writer_seek(hqr_writer_t *w, int32_t offset)
+{
+    hqr_writer_flush(w);
+
+    if (fseek(w->file, offset, SEEK_SET) != 0)
+	w->failed = 1;
+}
+
+
+/* Makes the offset index match the entries again, for after hqr_update(). */
+static int32_t
+hqr_offsets_rebuild(hqr_t *hqr, int32_t file_size)
+{
+    hqr_offset_t ho;
+    int32_t i;
+
+    hqr_offsets_clear(hqr);
+
+    for (i = 0; i <= hqr->entries_no; i++) {
+	if ((i < hqr->entries_no) && (hqr->entries[i].entry_type != ENTRY_NORMAL))
+		continue;
+
+	hqr_offset_init(&ho);
+	ho.offset = (i < hqr->entries_no) ? hqr->entries[i].offset : file_size;
+	ho.entry = i;
+	if (!hqr_offset_add(hqr, ho))
 		return 0;
     }
 
-    if (add_as_child) {
-	if (hqr->entries[entry].children_no == 0)
-		hqr->entries[entry].children = (hqr_common_t *) malloc((hqr->entries[entry].children_no + 1) *
-								sizeof(hqr_common_t));
-	else
-		hqr->entries[entry].children = (hqr_common_t *) realloc(hqr->entries[entry].children,
-								(hqr->entries[entry].children_no + 1) * sizeof(hqr_common_t));
+    qsort(hqr->offsets, hqr->offsets_no, sizeof(hqr_offset_t), hqr_compare_offsets);
 
-	if (child < hqr->entries[entry].children_no) {
-		for (i = hqr->entries[entry].children_no; i > child; i--)
-			hqr->entries[entry].children[i] = hqr->entries[entry].children[i - 1];
+    return 1;
+}
+
+
+/* Writes the changes made to an archive since it was loaded from path, or
+   since the last hqr_update(), into that file, without rewriting it: the
+   entries that changed are appended to the end of the file, then the
+   offset table is written over, and where they were becomes free space.
+   The other entries are neither read nor written. An entry counts as
+   changed when hqr_entry_replace() or hqr_entry_insert() gave it new data
+   or children, when one of its children was deleted, and when the table
+   grows over it. Free space stays in the file, see hqr->free_size, until
+   hqr_compact().
+
+   The game takes the first offset in the table that is not NULL for where
+   the table ends, so the entry it points to is never appended: if it has
+   to move, it is written right after the table, over the space the table
+   and the changed entries leave there, and if that space is too small the
+   archive is rewritten with hqr_compact() instead. Returns 1 on success,
+   0 on error. */
+int32_t
+hqr_update(hqr_t *hqr, char *path)
+{
+    hqr_writer_t w;
+    hqr_entry_t *he;
+    hqr_offset_t *chains = NULL;
+    uint8_t *changed = NULL;
+    int32_t *offsets = NULL;
+    int32_t table_end, file_size, end, next, limit, keep_end;
+    int32_t first = UNUSED, move_first = 0;
+    int32_t i, j, k, n = 0, ret = 0;
+    int64_t offset;
+    uint8_t hdr[10];
+
+    if ((hqr == NULL) || (path == NULL) || (hqr->file_size == 0))
+	return 0;
+
+    memset(&w, 0x00, sizeof(hqr_writer_t));
+
+    table_end = (hqr->entries_no + 1) << 2;
+    offsets = (int32_t *) malloc((hqr->entries_no + 1) * sizeof(int32_t));
+    changed = (uint8_t *) calloc(hqr->entries_no + 1, 1);
+    chains = (hqr_offset_t *) malloc((hqr->entries_no + 1) * sizeof(hqr_offset_t));
+    if ((offsets == NULL) || (changed == NULL) || (chains == NULL))
+	goto done;
+
+    for (i = 0; i < hqr->entries_no; i++) {
+	if (hqr->entries[i].entry_type == ENTRY_NORMAL)
+		changed[i] = hqr_entry_changed(&hqr->entries[i], table_end);
+    }
+
+    /* The first entry in the table that is not NULL, or the one it points
+       to, has to start where the table ends. There is room for it up to
+       the first entry that stays where it is. */
+    for (i = 0; (i < hqr->entries_no) && (hqr->entries[i].entry_type == ENTRY_NULL); i++)
+	;
+    if (i < hqr->entries_no) {
+	first = (hqr->entries[i].entry_type == ENTRY_POINTER) ? hqr->entries[i].parent : i;
+	if ((first < 0) || (first >= hqr->entries_no) || (hqr->entries[first].entry_type != ENTRY_NORMAL))
+		goto done;
+    }
+
+    limit = hqr->file_size;
+    for (i = 0; i < hqr->entries_no; i++) {
+	if ((hqr->entries[i].entry_type == ENTRY_NORMAL) && (i != first) && !changed[i] &&
+	    (hqr->entries[i].offset < limit))
+		limit = hqr->entries[i].offset;
+    }
+
+    keep_end = table_end;
+    if ((first == UNUSED) && (hqr->file_size != table_end)) {
+	ret = hqr_compact(hqr, path);
+	goto done;
+    } else if ((first != UNUSED) && (changed[first] || (hqr->entries[first].offset != table_end))) {
+	he = &hqr->entries[first];
+	offset = (int64_t) table_end + 10 + he->comp_size;
+	for (j = 0; j < he->children_no; j++)
+		offset += 10 + he->children[j].comp_size;
+
+	/* What is left up to there needs room for a free space header. */
+	if ((offset != limit) && ((offset + 10) > limit)) {
+		ret = hqr_compact(hqr, path);
+		goto done;
 	}
 
-	hqr->entries[entry].children[child] = hc;
-	hqr->entries[entry].children_no++;
-    } else {
-	if (hqr->entries_no == 0)
-		hqr->entries = (hqr_entry_t *) malloc((hqr->entries_no + 1) * sizeof(hqr_entry_t));
-	else
-		hqr->entries = (hqr_entry_t *) realloc(hqr->entries, (hqr->entries_no + 1) * sizeof(hqr_entry_t));
+	/* It can be written over where it is read from, so the data an
+	   index-only load left in the file is read first. The free space
+	   header after it is written over too. */
+	if ((he->comp_size > 0) && !hqr_entry_load(hqr, (hqr_common_t *) he))
+		goto done;
+	for (j = 0; j < he->children_no; j++) {
+		if ((he->children[j].comp_size > 0) && !hqr_entry_load(hqr, &he->children[j]))
+			goto done;
+	}
+	hqr->heap = 1;
 
-	/* Update parents. */
-	for (i = 0; i < hqr->entries_no; i++) {
-		 if (hqr->entries[i].parent >= entry)
-			hqr->entries[i].parent++;
+	changed[first] = 1;
+	move_first = 1;
+	keep_end = (int32_t) offset + 10;
+    }
+
+    /* The offsets the entries end up at, the changed ones from the end of
+       the file on, each followed by its children. */
+    offset = hqr->file_size;
+    for (i = 0; i < hqr->entries_no; i++) {
+	he = &hqr->entries[i];
+	offsets[i] = 0x00000000;
+
+	if (he->entry_type != ENTRY_NORMAL)
+		continue;
+
+	/* Data that was mapped from where an entry used to be can be where
+	   the table or the first entry goes now. */
+	if (!hqr_data_keep(hqr, (hqr_common_t *) he, keep_end))
+		goto done;
+	for (j = 0; j < he->children_no; j++) {
+		if (!hqr_data_keep(hqr, &he->children[j], keep_end))
+			goto done;
 	}
 
-	if (entry < hqr->entries_no) {
-		for (i = hqr->entries_no; i > entry; i--)
-			hqr->entries[i] = hqr->entries[i - 1];
+	if (!changed[i]) {
+		offsets[i] = he->offset;
+		continue;
+	}
+
+	if ((he->data == NULL) && (he->comp_size > 0) && (hqr->file == NULL))
+		goto done;
+	for (j = 0; j < he->children_no; j++) {
+		if ((he->children[j].data == NULL) && (he->children[j].comp_size > 0) && (hqr->file == NULL))
+			goto done;
 	}
 
-	hqr->entries[entry] = (hqr_entry_t *) hc;
-	hqr_->ntries_no++;
+	if (i == first) {
+		offsets[i] = table_end;
+		continue;
+	}
+
+	offsets[i] = (int32_t) offset;
+	offset += 10 + he->comp_size;
+	for (j = 0; j < he->children_no; j++)
+		offset += 10 + he->children[j].comp_size;
+
+	if (offset > INT32_MAX)
+		goto done;
     }
+    file_size = offsets[hqr->entries_no] = (int32_t) offset;
 
-    return 1;
+    for (i = 0; i < hqr->entries_no; i++) {
+	if (hqr->entries[i].entry_type != ENTRY_POINTER)
+		continue;
+
+	j = hqr->entries[i].parent;
+	if ((j < 0) || (j >= hqr->entries_no) || (hqr->entries[j].entry_type != ENTRY_NORMAL))
+		goto done;
+	offsets[i] = offsets[j];
+    }
+
+    w.buf = (uint8_t *) malloc(HQR_WRITE_SIZE);
+    w.file = fopen(path, "r+b");
+    if ((w.buf == NULL) || (w.file == NULL))
+	goto done;
+
+    /* Make sure that this is still the file the archive was read from. */
+    if ((fseek(w.file, 0, SEEK_END) != 0) || (ftell(w.file) != hqr->file_size))
+	goto done;
+
+    /* The changed entries first, while the table still points to where
+       they were, so that an update cut short before the table is written
+       leaves the archive as it was, unless the first entry moves too. */
+    for (i = 0; (i < hqr->entries_no) && !w.failed; i++) {
+	if (!changed[i] || (i == first))
+		continue;
+
+	he = &hqr->entries[i];
+	hqr_writer_entry(&w, hqr, (hqr_common_t *) he);
+	for (j = 0; j < he->children_no; j++)
+		hqr_writer_entry(&w, hqr, &he->children[j]);
+    }
+
+    if (move_first) {
+	he = &hqr->entries[first];
+	hqr_writer_seek(&w, table_end);
+	hqr_writer_entry(&w, hqr, (hqr_common_t *) he);
+	for (j = 0; j < he->children_no; j++)
+		hqr_writer_entry(&w, hqr, &he->children[j]);
+    }
+
+    hqr_writer_seek(&w, 0);
+    for (i = 0; i <= hqr->entries_no; i++)
+	hqr_writer_put32(&w, offsets[i]);
+    hqr_writer_flush(&w);
+    if (w.failed || (fflush(w.file) != 0))
+	goto done;
+
+    /* The new places of the changed entries, from here on. */
+    for (i = 0; i < hqr->entries_no; i++) {
+	he = &hqr->entries[i];
+
+	/* A pointer borrows the decompressed data, which may have moved. */
+	if (he->entry_type == ENTRY_POINTER) {
+		he->offset = offsets[i];
+		he->dec = hqr->entries[he->parent].dec;
+	}
+	if (!changed[i])
+		continue;
+
+	he->offset = offsets[i];
+	he->size_next_off = end = he->offset + 10 + he->comp_size;
+	for (j = 0; j < he->children_no; j++) {
+		he->children[j].offset = end;
+		he->children[j].size_next_off = end = end + 10 + he->children[j].comp_size;
+	}
+
+	he->tbl_next_off = end;
+	for (j = 0; j < he->children_no; j++)
+		he->children[j].tbl_next_off = end;
+    }
+
+    /* Free space follows an entry where what used to come after it is
+       gone. It gets a header that covers it up to the next entry, for the
+       loader to skip. */
+    for (i = 0; i < hqr->entries_no; i++) {
+	if (hqr->entries[i].entry_type != ENTRY_NORMAL)
+		continue;
+	chains[n].offset = hqr->entries[i].offset;
+	chains[n].entry = i;
+	n++;
+    }
+    qsort(chains, n, sizeof(hqr_offset_t), hqr_compare_offsets);
+
+    hqr->free_size = file_size - table_end;
+    for (k = 0; k < n; k++) {
+	end = hqr->entries[chains[k].entry].tbl_next_off;
+	next = ((k + 1) < n) ? chains[k + 1].offset : file_size;
+	hqr->free_size -= end - chains[k].offset;
+
+	if ((next - end) < 10)
+		continue;
+
+	for (i = 0; i < 4; i++) {
+		hdr[i] = 0x00;
+		hdr[4 + i] = ((next - end - 10) >> (i << 3)) & 0xff;
+	}
+	hdr[8] = hdr[9] = HQR_FREE & 0xff;
+
+	hqr_writer_seek(&w, end);
+	hqr_writer_put(&w, hdr, 10);
+    }
+    hqr_writer_flush(&w);
+
+    hqr->file_size = file_size;
+    ret = !w.failed && hqr_offsets_rebuild(hqr, file_size);
+
+done:
+    if ((w.file != NULL) && (fclose(w.file) != 0))
+	ret = 0;
+
+    free(w.buf);
+    free(chains);
+    free(changed);
+    free(offsets);
+
+    return ret;
 }
 
 
-#if 0
-static void
-hqr_file_open_w(hqr_t *hqr, char *path)
+/* Rewrites the archive loaded from path with hqr_save(), which leaves out
+   the free space of hqr_update(), and loads it again the way it was
+   loaded. The new file is written next to it first, and replaces it
+   once complete. Returns 1 on success, 0 on error. */
+int32_t
+hqr_compact(hqr_t *hqr, char *path)
 {
-    if (hqr->file != NULL)
-	hqr->file_close();
+    char *tmp;
+    int lazy, mapped;
+    int32_t ret;
+
+    if ((hqr == NULL) || (path == NULL))
+	return 0;
+
+    tmp = (char *) malloc(strlen(path) + 5);
+    if (tmp == NULL)
+	return 0;
+    sprintf(tmp, "%s.tmp", path);
+
+    if (!hqr_save(hqr, tmp, 1)) {
+	remove(tmp);
+	free(tmp);
+	return 0;
+    }
+
+    lazy = (hqr->file != NULL);
+    mapped = (hqr->map != NULL);
+
+    hqr_free(hqr);
+    hqr_file_close(hqr);
+    hqr_unmap(hqr);
+
+    /* If the old file can not go, it stays, and so does the archive. */
+    ret = (remove(path) == 0);
+    if (ret)
+	ret = (rename(tmp, path) == 0);
+    else
+	remove(tmp);
+    free(tmp);
+
+    if (mapped)
+	return hqr_load_mmap(hqr, path) && ret;
+    else if (lazy)
+	return hqr_load_index(hqr, path) && ret;
 
-    hqr->file = fopen(path, "wb");
+    return hqr_load(hqr, path) && ret;
 }
-#endif
 
 
+/* Frees all the entries. The data and the children arrays read by the
+   loader are in the arena, which goes in one go, so the entries only have
+   to be walked if anything else was attached to them since. */
 void
 hqr_free(hqr_t *hqr)
 {
-    int32_t i;
+    int32_t i, j;
 
-    for (i = 0; i < hqr->entries_no; i++) {
-	if (hqr->entries[i].desc != NULL) {
-		free(hqr->entries[i].desc);
-		hqr->entries[i].desc = NULL;
-	}
+    for (i = 0; hqr->heap && (i < hqr->entries_no); i++) {
+	if (hqr->entries[i].entry_type != ENTRY_POINTER)
+		hqr_dec_free((hqr_common_t *) &hqr->entries[i]);
+	hqr->entries[i].dec = NULL;
 
-	if (hqr->entries[i].data != NULL) {
-		free(hqr->entries[i].data);
-		hqr->entries[i].data = NULL;
-	}
+	hqr_data_free(hqr, hqr->entries[i].desc);
+	hqr_data_free(hqr, hqr->entries[i].data);
 
-	if (hqr->entries[i].children != NULL) {
-		free(hqr->entries[i].children);
-		hqr->entries[i].children = NULL;
+	for (j = 0; j < hqr->entries[i].children_no; j++) {
+		hqr_dec_free(&hqr->entries[i].children[j]);
+		hqr_data_free(hqr, hqr->entries[i].children[j].desc);
+		hqr_data_free(hqr, hqr->entries[i].children[j].data);
 	}
+	hqr_data_free(hqr, (uint8_t *) hqr->entries[i].children);
     }
 
     free(hqr->entries);
     hqr->entries = NULL;
 
-    hqr->entries_no = 0;
+    hqr->entries_no = hqr->entries_size = 0;
+    hqr->file_size = hqr->free_size = 0;
+    hqr->heap = 0;
+
+    hqr_cache_flush(hqr);
+
+    hqr_offsets_clear(hqr);
+    hqr_arena_free(hqr);
 }
 
 
@@ -747,7 +3145,9 @@ void
 hqr_close(hqr_t *hqr)
 {
     hqr_free(hqr);
+    hqr_cache_free(hqr);
     hqr_file_close(hqr);
+    hqr_unmap(hqr);
 
     free(hqr);
 }
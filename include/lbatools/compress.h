@@ -2,8 +2,68 @@
 # define LBATOOLS_COMPRESS_H
 
 
+/* Encoder context, holding all the scratch state the LZ encoders need.
+   A context may be reused for any number of calls, but must only be used
+   by one thread at a time - use one context per thread. */
+typedef struct comp_ctx_t	comp_ctx_t;
+
+
+/* Match finder engines for the LZ types. The tree engine is the one the
+   original encoders use and produces the same output as them unless it is
+   capped with comp_ctx_set_depth_limit(), the hash engine trades a little
+   ratio for a lot of speed and is tuned with comp_ctx_set_chain_limit()
+   and comp_ctx_set_lazy(). The reference engine is the original,
+   unoptimized LZMIT tree, kept for comparisons (for LZSS it is the same
+   as the tree engine). */
+#define COMP_ENGINE_TREE	0
+#define COMP_ENGINE_HASH	1
+#define COMP_ENGINE_TREE_REF	2
+
+/* Parsers for the LZ types. The greedy parser takes the longest match at
+   every position, the optimal parser picks the token sequence with the
+   smallest total size; it is several times slower and meant for release
+   builds of archives. Both write streams decompress_lz() can decode. */
+#define COMP_PARSE_GREEDY	0
+#define COMP_PARSE_OPTIMAL	1
+
+/* Compression levels, a shorthand for the settings above. Level 0 is what
+   a new context does, the original encoders; levels 1 to 8 use the hash
+   engine with a longer chain search at every level and lazy matching from
+   level 4 on, and level 9 is the optimal parser. */
+#define COMP_LEVEL_DEFAULT	0
+#define COMP_LEVEL_FASTEST	1
+#define COMP_LEVEL_BEST		9
+
+/* Thresholds for the pre-scan that makes the LZ encoders give up early on
+   data that will not compress, such as already compressed audio. New
+   contexts do not scan, so the encoders output what they always did, but
+   hqr_entry_new() compresses with COMP_SCAN_DEFAULT. The scan's size
+   estimate for random data is 1125 per mille, and since it can miss
+   matches the encoders would find, it can give up on data that does
+   compress: COMP_SCAN_DEFAULT only catches data that looks close to
+   random, and a lower threshold gives up sooner. */
+#define COMP_SCAN_OFF		0
+#define COMP_SCAN_DEFAULT	1100
+
+
+extern comp_ctx_t *	comp_ctx_new(void);
+extern void	comp_ctx_free(comp_ctx_t *ctx);
+extern void	comp_ctx_set_engine(comp_ctx_t *ctx, int engine);
+extern void	comp_ctx_set_parse(comp_ctx_t *ctx, int parse);
+extern void	comp_ctx_set_chain_limit(comp_ctx_t *ctx, int32_t limit);
+extern void	comp_ctx_set_depth_limit(comp_ctx_t *ctx, int32_t limit);
+extern void	comp_ctx_set_lazy(comp_ctx_t *ctx, int lazy);
+extern void	comp_ctx_set_level(comp_ctx_t *ctx, int level);
+extern void	comp_ctx_set_scan(comp_ctx_t *ctx, int32_t threshold);
+
+extern int32_t	compress_ctx(comp_ctx_t *ctx, int16_t type, char *output, char *input, int32_t length);
+extern int32_t	compress_lz_ctx(comp_ctx_t *ctx, int16_t type, char *output, char *input, int32_t length);
+extern int32_t	compress_lzss_ctx(comp_ctx_t *ctx, char *output, char *input, int32_t length);
+extern int32_t	compress_lzmit_ctx(comp_ctx_t *ctx, char *output, char *input, int32_t length);
+
 extern int32_t	compress(int16_t type, char *output, char *input, int32_t length);
 extern int32_t	compress_lz(int16_t type, char *output, char *input, int32_t length);
+extern int32_t	compress_level(int16_t type, int level, char *output, char *input, int32_t length);
 extern int32_t	compress_store(char *output, char *input, int32_t length);
 extern int32_t	compress_lzss(char *output, char *input, int32_t length);
 extern int32_t	compress_lzmit(char *output, char *input, int32_t length);
@@ -12,6 +72,72 @@ extern int32_t	decompress(int16_t type, char *output, char *input, int32_t lengt
 extern int32_t	decompress_lz(int16_t type, char *output, char *input, int32_t length);
 
 
+/* Variants with an output capacity. compress_bound() is the buffer size
+   any encoder may need, compress_safe() fails (-1) rather than write past
+   out_size or output something no smaller than the input, and
+   decompress_safe() fails rather than write past out_size or follow a
+   corrupt stream outside the buffer. For in-place decompression, read the
+   compressed data into the end of a buffer of the decompressed size plus
+   decompress_margin() and call decompress_in_place(). */
+extern int32_t	compress_bound(int16_t type, int32_t length);
+extern int32_t	compress_safe_ctx(comp_ctx_t *ctx, int16_t type, char *output, int32_t out_size,
+				  char *input, int32_t length);
+extern int32_t	compress_safe(int16_t type, char *output, int32_t out_size, char *input, int32_t length);
+
+extern int32_t	decompress_safe(int16_t type, char *output, int32_t out_size, char *input, int32_t length);
+extern int32_t	decompress_lz_safe(int16_t type, char *output, int32_t out_size, char *input, int32_t length);
+extern int32_t	decompress_margin(int16_t type, int32_t dec_size);
+extern int32_t	decompress_in_place(int16_t type, char *buf, int32_t buf_size, int32_t comp_size);
+
+
+/* Batch encoder for many small buffers: compresses count inputs one after
+   the other with the same context into one arena, the output of input i
+   being arena[offsets[i]] up to arena[offsets[i + 1]], so offsets needs
+   count + 1 elements. An input the type
+   does not make smaller is stored, and types[i] (if types is not NULL)
+   says which it was, so an arena as big as all the inputs together is
+   always enough. Returns the total size, or -1 if the arena is full. */
+typedef struct
+{
+    char *		data;
+    int32_t		length;
+} comp_span_t;
+
+
+extern int32_t	compress_batch_ctx(comp_ctx_t *ctx, int16_t type, const comp_span_t *inputs, int32_t count,
+				   char *arena, int32_t arena_size, int32_t *offsets, int16_t *types);
+extern int32_t	compress_batch(int16_t type, const comp_span_t *inputs, int32_t count,
+			       char *arena, int32_t arena_size, int32_t *offsets, int16_t *types);
+
+
+/* Streaming encoder: push input with comp_stream_write() in chunks of any
+   size, the compressed stream is handed to the write callback as it is
+   made (the callback returns the number of bytes it took). Uses constant
+   memory; comp_stream_finish() flushes the rest and returns the total. */
+typedef struct comp_stream_t	comp_stream_t;
+typedef int32_t (*comp_write_t)(void *priv, const char *buf, int32_t len);
+
+
+extern comp_stream_t *	comp_stream_new(int16_t type, comp_write_t write, void *priv);
+extern void	comp_stream_free(comp_stream_t *cs);
+extern void	comp_stream_set_chain_limit(comp_stream_t *cs, int32_t limit);
+extern int32_t	comp_stream_write(comp_stream_t *cs, const char *input, int32_t length);
+extern int64_t	comp_stream_finish(comp_stream_t *cs);
+
+
+/* Streaming decoder: feed it the compressed data in chunks of any size with
+   decomp_stream_run() and it writes as much output as fits in the buffer
+   given, remembering where it was inside a token. Keeps 4 KB of history. */
+typedef struct decomp_stream_t	decomp_stream_t;
+
+
+extern decomp_stream_t *	decomp_stream_new(int16_t type);
+extern void	decomp_stream_reset(decomp_stream_t *ds, int16_t type);
+extern void	decomp_stream_free(decomp_stream_t *ds);
+extern int32_t	decomp_stream_run(decomp_stream_t *ds, const char *input, int32_t in_len, int32_t *in_used,
+				  char *output, int32_t out_size);
+
+
 #define decompress_store	compress_store
 
 
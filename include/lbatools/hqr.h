@@ -9,6 +9,7 @@ typedef struct
     int32_t		offset;
     int32_t		tbl_next_off, size_next_off;
     uint8_t		*desc, *data;
+    uint8_t		*dec;				/* Decompressed data, if any. */
 
     uintptr_t		pad0;
     int32_t		pad1, parent;
@@ -22,6 +23,7 @@ typedef struct
     int32_t		offset;
     int32_t		tbl_next_off, size_next_off;
     uint8_t		*desc, *data;
+    uint8_t		*dec;				/* Decompressed data, if any. */
 
     hqr_common_t 	*children;
     int32_t		children_no;
@@ -36,12 +38,40 @@ typedef struct
 } hqr_offset_t;
 
 
+/* Load profile for HQR_COMPRESS_AUTO, given to hqr_entry_new_profile():
+   how fast the archive is read, in MB per second, and how much slower the
+   CPU that decodes it is than the one packing it. The cost of an entry is
+   its read time plus its scaled decode time, and the type with the lowest
+   cost wins. */
+typedef struct
+{
+    double		read_mbs, cpu_scale;
+} hqr_profile_t;
+
+
+/* Compression type for hqr_entry_new() that tries Store, LZSS and LZMIT,
+   the LZ types in parallel, and keeps the cheapest to load. */
+#define HQR_COMPRESS_AUTO		-1
+
+/* Presets for hqr_profile_preset(). */
+#define HQR_PROFILE_BALANCED		0	/* SATA SSD, CPU like this one. */
+#define HQR_PROFILE_SLOW_DISK		1	/* CD-ROM or old hard disk. */
+#define HQR_PROFILE_FAST_DISK_SLOW_CPU	2	/* NVMe, CPU 4 times slower. */
+
+
 typedef struct
 {
     hqr_entry_t		*entries;
-    hqr_offset_t	*offsets;
+    hqr_offset_t	*offsets;			/* Sorted by offset. */
     int32_t		entries_no, offsets_no;
+    int32_t		entries_size, offsets_size;	/* Allocated. */
     FILE *		file;
+    uint8_t *		map;				/* Mapping for hqr_load_mmap(). */
+    int32_t		map_size;
+    int32_t		file_size, free_size;		/* Loaded file, and its unused bytes. */
+    struct hqr_block_s	*arena;				/* Loaded data and children. */
+    int32_t		heap;				/* Entries hold malloc()ed data. */
+    struct hqr_cache_s	*cache;				/* See hqr_cache_init(). */
 } hqr_t;
 
 
@@ -49,9 +79,25 @@ extern hqr_t *	hqr_init(void);
 extern void	hqr_free(hqr_t *hqr);
 extern void	hqr_close(hqr_t *hqr);
 extern int32_t	hqr_load(hqr_t *hqr, char *path);
+extern int32_t	hqr_load_mmap(hqr_t *hqr, char *path);
+extern int32_t	hqr_load_index(hqr_t *hqr, char *path);
+extern int32_t	hqr_find_offset(hqr_t *hqr, int32_t offset);
+extern int32_t	hqr_save(hqr_t *hqr, char *path, int dedup);
+extern int32_t	hqr_update(hqr_t *hqr, char *path);
+extern int32_t	hqr_compact(hqr_t *hqr, char *path);
+extern uint8_t *	hqr_entry_get(hqr_t *hqr, int32_t entry, int32_t child, int decompress);
 extern int32_t	hqr_entry_delete(hqr_t *, int32_t entry, int32_t delete_children);
+extern int32_t	hqr_decompress_all(hqr_t *hqr, int threads);
+extern int32_t	hqr_cache_init(hqr_t *hqr, int64_t budget);
+extern uint8_t *	hqr_cache_get(hqr_t *hqr, int32_t entry, int32_t child, int32_t *size);
+extern void	hqr_cache_release(hqr_t *hqr, uint8_t *dec);
+extern void	hqr_cache_flush(hqr_t *hqr);
+extern void	hqr_cache_stats(hqr_t *hqr, int64_t *hits, int64_t *misses, int64_t *bytes);
+extern hqr_profile_t	hqr_profile_preset(int profile);
 extern hqr_common_t	hqr_entry_new(int32_t entry_type, int32_t parent, int32_t dec_size, int16_t comp_type, char *buf);
-extern int32_t	hqr_entry_insert(hqr_t *hqr, int32_t entry, int32_t child, hqr_common_t hc, int32_t add_as_child, char *buf);
+extern hqr_common_t	hqr_entry_new_profile(int32_t entry_type, int32_t parent, int32_t dec_size, int16_t comp_type, const hqr_profile_t *profile, char *buf);
+extern int32_t	hqr_entry_replace(hqr_t *hqr, int32_t entry, int32_t child, hqr_common_t hc);
+extern int32_t	hqr_entry_insert(hqr_t *hqr, int32_t entry, int32_t child, hqr_common_t hc, int32_t add_as_child);
 
 
 #endif	/*LBATOOLS_HQR_H*/
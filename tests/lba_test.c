@@ -0,0 +1,226 @@
+/* Checks for the library, run by the test target of the makefile. Exits
+   with 0 if all of them pass and 1 otherwise. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lbatools/compress.h>
+#include <lbatools/hqr.h>
+
+
+#define TEST_LENGTH	65536
+#define TEST_HQR	"lba_test.hqr"
+#define TEST_ENTRIES	64
+
+
+static uint32_t	seed = 0x12345678;
+
+
+static uint8_t
+test_random(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return (uint8_t) (seed >> 24);
+}
+
+
+/* Compresses with a context of its own and the given scan threshold. */
+static int32_t
+test_compress(int16_t type, int32_t scan, char *out, char *in, int32_t length)
+{
+    comp_ctx_t *ctx = comp_ctx_new();
+    int32_t ret;
+
+    comp_ctx_set_scan(ctx, scan);
+    ret = compress_ctx(ctx, type, out, in, length);
+    comp_ctx_free(ctx);
+
+    return ret;
+}
+
+
+/* The LZ encoders fail with the input length for LZSS and -1 for LZMIT. */
+static int
+test_failed(int16_t type, int32_t ret, int32_t length)
+{
+    return (type == 1) ? (ret >= length) : (ret < 0);
+}
+
+
+static int
+test_scan_run(const char *name, int16_t type, char *in, int32_t length, int compressible)
+{
+    char *out = (char *) malloc(compress_bound(type, length));
+    int32_t plain, off, on;
+    int ok;
+
+    plain = compress(type, out, in, length);
+    off = test_compress(type, COMP_SCAN_OFF, out, in, length);
+    on = test_compress(type, COMP_SCAN_DEFAULT, out, in, length);
+
+    if (compressible)
+	ok = !test_failed(type, off, length) && (plain == off) && (on == off);
+    else
+	ok = test_failed(type, on, length);
+
+    printf("%-8s %-5s plain %6i, scan off %6i, scan on %6i: %s\n", name, (type == 1) ? "LZSS" : "LZMIT",
+	   plain, off, on, ok ? "OK" : "FAILED");
+
+    free(out);
+
+    return ok;
+}
+
+
+/* hqr_entry_new() scans: it must store what the scan gives up on, and
+   compress the rest as compress() does. */
+static int
+test_scan_entry(const char *name, int16_t type, char *in, int32_t length, int compressible)
+{
+    char *out = (char *) malloc(compress_bound(type, length));
+    hqr_common_t hc;
+    int32_t plain;
+    int ok;
+
+    plain = compress(type, out, in, length);
+    hc = hqr_entry_new(1, -1, length, type, in);
+
+    if (compressible)
+	ok = (hc.comp_type == type) && (hc.comp_size == plain) && !memcmp(hc.data, out, plain);
+    else
+	ok = (hc.comp_type == 0) && (hc.comp_size == length);
+
+    printf("%-8s %-5s hqr_entry_new() type %i, size %6i: %s\n", name, (type == 1) ? "LZSS" : "LZMIT",
+	   hc.comp_type, hc.comp_size, ok ? "OK" : "FAILED");
+
+    free(hc.data);
+    free(out);
+
+    return ok;
+}
+
+
+/* The incompressibility pre-scan of the LZ encoders: data that repeats
+   within the 4 KB window must compress the same with the scan on as with
+   it off, however random each period looks, and random data must be
+   given up on. */
+static int
+test_scan(void)
+{
+    char *periodic, *random;
+    int16_t type;
+    int32_t i;
+    int ok = 1;
+
+    periodic = (char *) malloc(TEST_LENGTH);
+    random = (char *) malloc(TEST_LENGTH);
+
+    /* Random bytes that repeat every 2000 bytes: each 1 KB sample looks
+       random on its own, but every byte past the first period matches one
+       2000 bytes back. */
+    for (i = 0; i < 2000; i++)
+	periodic[i] = (char) test_random();
+    for (; i < TEST_LENGTH; i++)
+	periodic[i] = periodic[i - 2000];
+
+    for (i = 0; i < TEST_LENGTH; i++)
+	random[i] = (char) test_random();
+
+    for (type = 1; type <= 2; type++) {
+	ok &= test_scan_run("Periodic", type, periodic, TEST_LENGTH, 1);
+	ok &= test_scan_run("Random", type, random, TEST_LENGTH, 0);
+	ok &= test_scan_entry("Periodic", type, periodic, TEST_LENGTH, 1);
+	ok &= test_scan_entry("Random", type, random, TEST_LENGTH, 0);
+    }
+
+    free(random);
+    free(periodic);
+
+    return ok;
+}
+
+
+/* Inserts a normal entry of size bytes of value at entry. */
+static int
+test_insert(hqr_t *hqr, int32_t entry, int32_t size, char value)
+{
+    char buf[256];
+    hqr_common_t hc;
+
+    memset(buf, value, size);
+    hc = hqr_entry_new(1, -1, size, 1, buf);
+
+    if (hqr_entry_insert(hqr, entry, 0, hc, 0))
+	return 1;
+
+    free(hc.data);
+    return 0;
+}
+
+
+/* Whether entry is there with size bytes of value. */
+static int
+test_entry(hqr_t *hqr, int32_t entry, int32_t size, char value)
+{
+    uint8_t *dec = hqr_entry_get(hqr, entry, -1, 1);
+    int32_t i;
+
+    if (dec == NULL)
+	return 0;
+
+    for (i = 0; i < size; i++) {
+	if (dec[i] != (uint8_t) value)
+		return 0;
+    }
+
+    return 1;
+}
+
+
+/* hqr_entry_insert() into an empty archive, and appending at the end of
+   one whose entries array is exactly full. */
+static int
+test_hqr_insert(void)
+{
+    hqr_t *hqr = hqr_init();
+    int32_t i;
+    int ok;
+
+    ok = test_insert(hqr, 0, 100, 'a') && (hqr->entries_no == 1);
+    ok = ok && test_insert(hqr, 1, 200, 'b') && (hqr->entries_no == 2);
+    for (i = 2; ok && (i < TEST_ENTRIES); i++)
+	ok = test_insert(hqr, i, 10 + i, (char) i);
+    ok = ok && hqr_save(hqr, TEST_HQR, 0);
+    hqr_close(hqr);
+
+    hqr = hqr_init();
+    ok = ok && hqr_load(hqr, TEST_HQR) && (hqr->entries_no == TEST_ENTRIES);
+    ok = ok && test_insert(hqr, TEST_ENTRIES, 50, 'z') && (hqr->entries_no == (TEST_ENTRIES + 1));
+    ok = ok && test_entry(hqr, 0, 100, 'a') && test_entry(hqr, 1, 200, 'b') &&
+	 test_entry(hqr, TEST_ENTRIES - 1, 10 + TEST_ENTRIES - 1, (char) (TEST_ENTRIES - 1)) &&
+	 test_entry(hqr, TEST_ENTRIES, 50, 'z');
+    hqr_close(hqr);
+    remove(TEST_HQR);
+
+    printf("HQR insert into an empty archive and at the end: %s\n", ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+
+int
+main(void)
+{
+    int ok = 1;
+
+    ok &= test_scan();
+    ok &= test_hqr_insert();
+
+    printf("%s\n", ok ? "All tests passed" : "Some tests FAILED");
+
+    return ok ? 0 : 1;
+}